@@ -0,0 +1,272 @@
+/** @file Benchmarks of the framework's own hot paths - the event loop operations and the fixed
+ *  overhead of running a test. Each result is printed on a separate line, in the form
+ *  <name> <value> <unit>, with lower values being better. The results are also checked and
+ *  recorded via the performance baseline options (--baseline=FILE, --save-baseline=FILE),
+ *  under the key 'asyncTest-bench', so that changes can be compared over time, i.e.:
+ *    ./bench --save-baseline=bench.base     (on the reference version, several times)
+ *    ./bench --baseline=bench.base          (on the changed version)
+ *  @author Alexander Vassilev
+ */
+
+#include <asyncTest.hpp>
+#include <algorithm>
+#include <fcntl.h>
+
+TESTS_INIT();
+
+using namespace test;
+typedef std::chrono::steady_clock Clock;
+
+static const char* kBenchKey = "asyncTest-bench";
+static int sNumRegressions = 0;
+
+static double nsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+static double medianOf(std::vector<double>& values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+/** Runs the measurement several times and returns the median, to filter out noise */
+template <class F>
+static double median(F&& func, int runs=5)
+{
+    std::vector<double> results;
+    for (int i = 0; i < runs; i++)
+        results.push_back(func());
+    return medianOf(results);
+}
+static void report(const char* name, double value, const char* unit)
+{
+    printf("%-28s %12.3f  %s\n", name, value, unit);
+    auto err = gPerfBaseline.compare(kBenchKey, name, value);
+    if (!err.empty())
+    {
+        printf("  %s%s%s\n", kColorFail, err.c_str(), kColorNormal);
+        sNumRegressions++;
+        return;
+    }
+    gPerfBaseline.record(kBenchKey, name, value);
+}
+/** Redirects stdout to /dev/null during its lifetime, to hide the test log */
+class StdoutSilencer
+{
+    int mSavedFd;
+public:
+    StdoutSilencer()
+    {
+        fflush(stdout);
+        mSavedFd = dup(1);
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, 1);
+        close(devNull);
+    }
+    ~StdoutSilencer()
+    {
+        fflush(stdout);
+        dup2(mSavedFd, 1);
+        close(mSavedFd);
+    }
+};
+
+/** Disables the performance baseline during its lifetime, so that the tests that are run in
+ * order to measure the framework's overhead are not compared and recorded */
+class BaselineSuspender
+{
+    std::string mBaseline;
+    std::string mSaveBaseline;
+public:
+    BaselineSuspender()
+    {
+        mBaseline.swap(gOptions.baselineFile);
+        mSaveBaseline.swap(gOptions.baselineSaveFile);
+    }
+    ~BaselineSuspender()
+    {
+        mBaseline.swap(gOptions.baselineFile);
+        mSaveBaseline.swap(gOptions.baselineSaveFile);
+    }
+};
+
+static void benchLoopConstruct()
+{
+    enum { kCount = 100000 };
+    report("loop_construct_destroy", median([]()
+    {
+        auto start = Clock::now();
+        for (int i = 0; i < kCount; i++)
+            EventLoop loop;
+        return nsSince(start) / kCount;
+    }), "ns/loop");
+}
+
+static void benchAddDone()
+{
+    enum { kLoops = 1000, kDones = 100 };
+    std::vector<std::string> tags;
+    for (int i = 0; i < kDones; i++)
+        tags.push_back("tag" + std::to_string(i));
+    report("addDone", median([&]()
+    {
+        double total = 0;
+        for (int i = 0; i < kLoops; i++)
+        {
+            EventLoop loop;
+            auto start = Clock::now();
+            for (auto& tag: tags)
+                loop.addDone(tag.c_str());
+            total += nsSince(start);
+        }
+        return total / (kLoops * kDones);
+    }), "ns/call");
+}
+
+static void benchSchedCall()
+{
+    enum { kCalls = 100000 };
+    std::vector<double> dispatchNs; //measured in the same runs, so its median is taken separately
+    report("schedCall", median([&]()
+    {
+        EventLoop loop;
+        size_t count = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < kCalls - 1; i++)
+            loop.schedCall([&count]() { count++; }, 0, 0);
+        loop.schedCall([&loop]() { loop.done(); }, 0, 0);
+        double schedNs = nsSince(start) / kCalls;
+        start = Clock::now();
+        loop.run();
+        dispatchNs.push_back(nsSince(start) / kCalls);
+        return schedNs;
+    }), "ns/call");
+    report("schedCall_dispatch", medianOf(dispatchNs), "ns/call");
+}
+
+/** Gives access to the constructor that takes a list of done() items */
+struct DoneLoop: public EventLoop
+{
+    using EventLoop::DoneItem;
+    DoneLoop(std::vector<DoneItem>&& items): EventLoop(std::move(items), 10000) {}
+};
+
+static void benchDone()
+{
+    enum { kDones = 10000 };
+    std::vector<std::string> tags;
+    for (int i = 0; i < kDones; i++)
+        tags.push_back("tag" + std::to_string(i));
+    std::vector<double> exitNs;
+    report("done", median([&]()
+    {
+        std::vector<DoneLoop::DoneItem> items;
+        for (auto& tag: tags)
+            items.emplace_back(tag.c_str());
+        DoneLoop loop(std::move(items));
+        double doneNs = 0;
+        Clock::time_point lastDone;
+        loop.schedCall([&]()
+        {
+            auto start = Clock::now();
+            for (auto& tag: tags)
+                loop.done(tag);
+            lastDone = Clock::now();
+            doneNs = std::chrono::duration<double, std::nano>(lastDone - start).count() / kDones;
+        }, 0, 0);
+        loop.run();
+        exitNs.push_back(nsSince(lastDone));
+        return doneNs;
+    }), "ns/call");
+    report("done_to_loop_exit", medianOf(exitNs) / 1000, "us");
+}
+
+static void benchFlightRecorder()
+{
+    enum { kEvents = 1000000 };
+    std::unique_ptr<FlightRecorder> recorder(new FlightRecorder());
+    report("flight_recorder_add", median([&]()
+    {
+        auto start = Clock::now();
+        for (int i = 0; i < kEvents; i++)
+            recorder->add(FlightRecorder::kCall, i, i, nullptr, SrcLoc(__FILE__, __LINE__));
+        return nsSince(start) / kEvents;
+    }), "ns/event");
+    if (recorder->format(0).empty()) //use the events, so that recording is not optimized out
+        abort();
+}
+
+static void benchTimerAccuracy()
+{
+    enum { kTimers = 20 };
+    std::vector<double> lateness;
+    EventLoop loop;
+    auto start = Clock::now();
+    for (int i = 1; i <= kTimers; i++)
+    {
+        loop.schedCall([&lateness, start, i]()
+        {
+            lateness.push_back(nsSince(start) / 1000 - i * 1000.0);
+        }, i, 0);
+    }
+    loop.schedCall([&loop]() { loop.done(); }, kTimers + 1, 0);
+    loop.run();
+    double sum = 0;
+    for (auto val: lateness)
+        sum += fabs(val);
+    report("timer_error_mean", sum / lateness.size(), "us");
+    report("timer_error_max", fabs(*std::max_element(lateness.begin(), lateness.end(),
+        [](double a, double b) { return fabs(a) < fabs(b); })), "us");
+}
+
+static void benchTestOverhead()
+{
+    enum { kTests = 2000 };
+    double syncUs = median([]()
+    {
+        auto start = Clock::now();
+        {
+            BaselineSuspender suspender;
+            StdoutSilencer silencer;
+            test::TestGroup group("bench sync", [](test::TestGroup& group)
+            {
+                for (int i = 0; i < kTests; i++)
+                    group.addTest("t" + std::to_string(i), nullptr, [](test::Test&) {});
+            });
+        }
+        return nsSince(start) / 1000 / kTests;
+    }, 3);
+    report("test_overhead_sync", syncUs, "us/test");
+    double asyncUs = median([]()
+    {
+        auto start = Clock::now();
+        {
+            BaselineSuspender suspender;
+            StdoutSilencer silencer;
+            test::TestGroup group("bench async", [](test::TestGroup& group)
+            {
+                for (int i = 0; i < kTests; i++)
+                {
+                    group.addTest("t" + std::to_string(i), new test::EventLoop(),
+                    [](test::Test&, test::EventLoop& loop) { loop.done(); }).startDelay(0);
+                }
+            });
+        }
+        return nsSince(start) / 1000 / kTests;
+    }, 3);
+    report("test_overhead_async", asyncUs, "us/test");
+}
+
+int main(int argc, char** argv)
+{
+    gOptions.parse(argc, argv);
+    printf("%-28s %12s  %s\n", "# benchmark", "value", "unit");
+    benchLoopConstruct();
+    benchAddDone();
+    benchSchedCall();
+    benchDone();
+    benchFlightRecorder();
+    benchTimerAccuracy();
+    benchTestOverhead();
+    return sNumRegressions ? 1 : 0;
+}
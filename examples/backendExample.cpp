@@ -0,0 +1,186 @@
+/** Running async tests on top of an external reactor. PollReactor stands in for the event loop
+ * of the production code, and PollReactorBackend adapts it to the test framework - while the
+ * test loop waits for its next scheduled call, the reactor dispatches its I/O events, on the
+ * same thread.
+ */
+#include "asyncTest.hpp"
+#include <functional>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+TESTS_INIT();
+
+/** A minimal poll()-based reactor, with a self-pipe for waking it up from other threads */
+class PollReactor
+{
+protected:
+    struct Watch
+    {
+        int fd;
+        std::function<void()> onReadable;
+    };
+    std::vector<Watch> mWatches;
+    std::vector<pollfd> mPollFds;
+    int mWakeupPipe[2];
+public:
+    PollReactor()
+    {
+        if (pipe(mWakeupPipe) != 0)
+            throw std::runtime_error("Can't create the wakeup pipe");
+        fcntl(mWakeupPipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(mWakeupPipe[1], F_SETFL, O_NONBLOCK);
+    }
+    ~PollReactor()
+    {
+        close(mWakeupPipe[0]);
+        close(mWakeupPipe[1]);
+    }
+    void watch(int fd, std::function<void()>&& onReadable)
+    {
+        mWatches.push_back(Watch{fd, std::move(onReadable)});
+    }
+    void unwatch(int fd)
+    {
+        for (auto it = mWatches.begin(); it != mWatches.end(); ++it)
+        {
+            if (it->fd == fd)
+            {
+                mWatches.erase(it);
+                return;
+            }
+        }
+    }
+/** Blocks until an fd becomes readable, the timeout elapses or wakeup() is called */
+    int poll(int timeoutMs)
+    {
+        mPollFds.clear();
+        mPollFds.push_back(pollfd{mWakeupPipe[0], POLLIN, 0});
+        for (auto& watch: mWatches)
+            mPollFds.push_back(pollfd{watch.fd, POLLIN, 0});
+        return ::poll(mPollFds.data(), mPollFds.size(), timeoutMs);
+    }
+/** Calls the handlers of the fds that poll() found readable */
+    void dispatch()
+    {
+        char buf[64];
+        while (read(mWakeupPipe[0], buf, sizeof(buf)) > 0); //drain the wakeups
+        for (size_t i = 1; i < mPollFds.size(); i++)
+        {
+            if (!(mPollFds[i].revents & (POLLIN | POLLHUP)))
+                continue;
+            for (auto& watch: mWatches) //a handler may have unwatched it
+            {
+                if (watch.fd == mPollFds[i].fd)
+                {
+                    auto handler = watch.onReadable;
+                    handler();
+                    break;
+                }
+            }
+        }
+    }
+    void wakeup()
+    {
+        if (write(mWakeupPipe[1], "w", 1) < 0) {} //if the pipe is full, a wakeup is pending anyway
+    }
+};
+
+/** Makes the test loop wait for its events in the reactor */
+class PollReactorBackend: public test::LoopBackend
+{
+protected:
+    PollReactor& mReactor;
+public:
+    PollReactorBackend(PollReactor& reactor): mReactor(reactor) {}
+    virtual void wait(long long ms, std::mutex& loopMutex)
+    {
+        {
+            test::Unlocker<std::mutex> unlock(loopMutex);
+            mReactor.poll((int)ms);
+        }
+        mReactor.dispatch();
+    }
+    virtual void wakeup() { mReactor.wakeup(); }
+};
+
+static PollReactor gReactor;
+static PollReactorBackend gBackend(gReactor);
+
+/** An echo "server" and a client, connected via a socket pair, both driven by the reactor */
+struct EchoPair
+{
+    int fds[2];
+    EchoPair()
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+            throw std::runtime_error("socketpair() failed");
+        gReactor.watch(fds[1], [this]()
+        {
+            char buf[64];
+            auto len = read(fds[1], buf, sizeof(buf));
+            if (len > 0 && write(fds[1], buf, len) != len)
+                throw std::runtime_error("echo write failed");
+        });
+    }
+    ~EchoPair()
+    {
+        gReactor.unwatch(fds[0]);
+        gReactor.unwatch(fds[1]);
+        close(fds[0]);
+        close(fds[1]);
+    }
+};
+
+int main()
+{
+    TestGroup("reactor backend")
+    {
+        asyncTest("echo", {"reply"})
+        {
+            loop.setBackend(&gBackend);
+            auto echo = std::make_shared<EchoPair>();
+            gReactor.watch(echo->fds[0], [&test, echo]()
+            {
+                char buf[64];
+                auto len = read(echo->fds[0], buf, sizeof(buf));
+                gReactor.unwatch(echo->fds[0]); //releases the EchoPair when done
+                checkEq(std::string(buf, len > 0 ? len : 0), std::string("ping"));
+                test.done("reply");
+            });
+            loop.schedCall([&test, echo]()
+            {
+                check(write(echo->fds[0], "ping", 4) == 4);
+            }, 20);
+        });
+        asyncTest("wait for a reply in the test body", {"_default"})
+        {
+            loop.setBackend(&gBackend);
+            EchoPair echo;
+            std::string reply;
+            gReactor.watch(echo.fds[0], [&]()
+            {
+                char buf[64];
+                auto len = read(echo.fds[0], buf, sizeof(buf));
+                if (len > 0)
+                    reply.append(buf, len);
+            });
+            check(write(echo.fds[0], "hello", 5) == 5);
+            check(loop.runUntil([&]() { return reply == "hello"; }, 1000));
+            test.done();
+        });
+        asyncTest("post from another thread")
+        {
+            loop.setBackend(&gBackend);
+            std::thread thread([&loop, &test]()
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                loop.post([&test]() { test.done(); });
+            });
+            bool posted = loop.waitFor("_default");
+            thread.join();
+            check(posted);
+        });
+    });
+    return test::gNumFailed;
+}
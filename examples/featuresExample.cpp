@@ -0,0 +1,290 @@
+/** Examples of the features of the framework, each with tests that pass, and with tests that
+ * must fail - their names start with "must fail". The run-features target in the Makefile
+ * checks that exactly these fail, and how they are reported. The crash example is run only if
+ * --crash is given, as it terminates the test run, unless run with --jobs=N
+ */
+#include "asyncTest.hpp"
+#include "property.hpp"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <string.h>
+
+TESTS_INIT();
+
+int main(int argc, char** argv)
+{
+    test::gOptions.parse(argc, argv);
+    TestGroup("complete on dones")
+    {
+        asyncTest("pending calls are cancelled")
+        {
+            loop.schedCall([&test]() { test.done(); }, 10);
+            loop.schedCall([&test]() { test.error("the call should have been cancelled"); }, 5000);
+        }).completeOnDones();
+        asyncTest("set from the test body", {"first", "second"})
+        {
+            loop.completeOnDones = true;
+            loop.schedCall([&test]() { test.done("first"); }, 5);
+            loop.schedCall([&test]() { test.done("second"); }, 10);
+            loop.schedCall([&test]() { test.error("the call should have been cancelled"); }, 5000);
+        });
+        asyncTest("must fail - a call within the grace period runs")
+        {
+            loop.schedCall([&test, &loop]()
+            {
+                test.done();
+                loop.schedCall([&test]() { test.error("the call within the grace period ran"); }, 20);
+            }, 5);
+        }).completeOnDones(200);
+        asyncTest("must fail - a done times out", {{"never", "timeout", 300}})
+        {
+            loop.schedCall([]() {}, 10);
+        }).completeOnDones();
+    });
+    TestGroup("start delay")
+    {
+        asyncTest("default start delay")
+        {
+            loop.schedCall([&test]() { test.done(); }, 0, 0);
+        });
+        asyncTest("no start delay")
+        {
+            loop.schedCall([&test]() { test.done(); }, 0, 0);
+        }).startDelay(0);
+    });
+    TestGroup("periodic calls and cancelling")
+    {
+        asyncTest("periodic call cancels itself")
+        {
+            auto count = std::make_shared<int>(0);
+            auto handle = std::make_shared<test::EventLoop::SchedHandle>();
+            *handle = loop.schedPeriodic([&test, count, handle]()
+            {
+                if (++*count == 5)
+                    check(handle->cancel());
+            }, 5);
+            loop.schedCall([&test, count, handle]()
+            {
+                checkEq(*count, 5);
+                check(!handle->isPending());
+                test.done();
+            }, 100);
+        });
+        asyncTest("cancelling a pending call")
+        {
+            auto handle = loop.schedCall([&test]() { test.error("the call should have been cancelled"); }, 20);
+            check(handle.isPending());
+            check(handle.cancel());
+            check(!handle.cancel());
+            loop.schedCall([&test]() { test.done(); }, 50);
+        });
+        asyncTest("a call is not pending while it executes")
+        {
+            auto handle = std::make_shared<test::EventLoop::SchedHandle>();
+            *handle = loop.schedCall([&test, handle]()
+            {
+                check(!handle->isPending());
+                check(!handle->cancel());
+                test.done();
+            }, 5);
+        });
+        asyncTest("must fail - periodic call runs until cancelled")
+        {
+            auto count = std::make_shared<int>(0);
+            loop.schedPeriodic([&test, count]()
+            {
+                checkLt(++*count, 3);
+            }, 5);
+            loop.schedCall([&test]() { test.done(); }, 100);
+        });
+    });
+    TestGroup("stress tests")
+    {
+        stressTest("each thread runs all iterations", 4, 10000)
+        {
+            static thread_local size_t count = 0;
+            checkEq(count, iteration);
+            count++;
+        });
+        stressTest("must fail - a thread fails at an iteration", 4, 1000)
+        {
+            if (test.index == 2)
+                checkNe(iteration, (size_t)100);
+        });
+    });
+    TestGroup("parameterized tests")
+    {
+        std::vector<int> positive{1, 2, 3}; //copied into the test
+        paramTest("positive", positive)
+        {
+            checkGt(param, 0);
+        });
+        size_t first = 10;
+        auto squares = [first](size_t idx) { return (first + idx) * (first + idx); }; //copied into the test
+        paramTestGen("squares", 100, squares)
+        {
+            auto root = (size_t)std::lround(std::sqrt((double)param));
+            checkEq(root * root, param);
+        });
+        std::vector<int> delays{5, 10};
+        asyncParamTest("async", delays)
+        {
+            loop.schedCall([&test]() { test.done(); }, param);
+        });
+        std::vector<int> odd{1, 3};
+        paramTest("must fail - odd numbers are even", odd)
+        {
+            checkEq(param % 2, 0);
+        });
+    });
+    TestGroup("test order")
+    {
+        std::vector<int> params{1, 2};
+        syncTest("order 1") {});
+        paramTest("order 2", params) {});
+        syncTest("order 3") {});
+    });
+    TestGroup("properties")
+    {
+        syncTest("reverse twice is identity")
+        {
+            test::property(test, "reverse twice", test::gen::vectorOf(test::gen::integer<int>()),
+            [](const std::vector<int>& vec)
+            {
+                auto copy = vec;
+                std::reverse(copy.begin(), copy.end());
+                std::reverse(copy.begin(), copy.end());
+                return copy == vec;
+            });
+        });
+        syncTest("on several threads, with check()")
+        {
+            test::property(test, test::PropertyConfig().cases(10000).threads(4), "sum is commutative",
+                test::gen::integer<int>(-1000, 1000), test::gen::integer<int>(-1000, 1000),
+            [&test](int a, int b)
+            {
+                checkEq(a + b, b + a);
+                return true;
+            });
+        });
+        syncTest("must fail - all integers are small")
+        {
+            test::property(test, "small", test::gen::integer<int>(0, 1000000), [](int x) { return x < 1000; });
+        });
+    });
+    TestGroup("comparison checks")
+    {
+        syncTest("operands are evaluated once")
+        {
+            int count = 0;
+            checkEq(++count, 1);
+            checkNe(count, 2);
+            checkLt(count, 2);
+            checkGe(std::max(count, 1), 1); //a comma within parentheses
+            checkNear(0.1 + 0.2, 0.3, 1e-9);
+        });
+        syncTest("must fail - strings are different")
+        {
+            std::string greeting = "hello";
+            checkEq(greeting, std::string("world"));
+        });
+    });
+    TestGroup("non-fatal checks")
+    {
+        syncTest("expectations that hold")
+        {
+            for (int i = 0; i < 10; i++)
+            {
+                expect(i >= 0);
+                expectLt(i, 10);
+            }
+        });
+        syncTest("must fail - all failures are reported")
+        {
+            for (int i = 0; i < 10; i++)
+            {
+                expectEq(i % 3, 0);
+                expectLt(i, 8);
+            }
+        });
+        syncTest("must fail - a check fails after expectations")
+        {
+            expectEq(1 + 1, 3);
+            checkEq(2 + 2, 5);
+        });
+    });
+    TestGroup("flight recorder")
+    {
+        asyncTest("must fail - the events before a failure are shown", {"first", "second"})
+        {
+            loop.schedCall([&test]() { test.done("first"); }, 10);
+            loop.schedCall([&test]() { test.error("failed after the first done"); }, 20);
+        }).startDelay(0);
+        asyncTest("no events of a passing test")
+        {
+            loop.schedCall([&test]() { test.done(); }, 10);
+        }).startDelay(0);
+    });
+    TestGroup("source locations")
+    {
+        asyncTest("must fail - a done() resolved twice", {"reply", "other"})
+        {
+            loop.schedCall([&test]() { test.done("reply"); }, 5);
+            loop.schedCall([&test]() { test.done("reply"); }, 10);
+        }).startDelay(0);
+        asyncTest("must fail - a done() and a call are pending on timeout", {{"reply", "timeout", 50}})
+        {
+            loop.schedCall([&test]() { test.done("reply"); }, 1000);
+        }).startDelay(0);
+    });
+    TestGroup("timeouts")
+    {
+        syncTest("completes within its timeout")
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }).timeout(1000);
+        syncTest("without a timeout")
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }).timeout(0);
+        stressTest("stress test within its timeout", 4, 100)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }).timeout(5000);
+    });
+    TestGroup("time report")
+    {
+        asyncTest("idle")
+        {
+            loop.schedCall([&test]() { test.done(); }, 50);
+        });
+        syncTest("busy")
+        {
+            auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+            while (std::chrono::steady_clock::now() < end);
+        });
+    });
+    bool crash = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--crash") == 0)
+            crash = true;
+    }
+    if (crash)
+    {
+        TestGroup("crash")
+        {
+            syncTest("must fail - null pointer dereference")
+            {
+                volatile int* ptr = nullptr;
+                *ptr = 1;
+            });
+            syncTest("after the crash")
+            {
+                check(true);
+            });
+        });
+    }
+    return test::gNumFailed;
+}
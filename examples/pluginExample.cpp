@@ -0,0 +1,18 @@
+/** An example test suite built as a plugin, to be run by asynctest-runner.
+ *  See the plugin-example.so target in the Makefile */
+#include "asyncTest.hpp"
+
+registerTestGroup("plugin group")
+{
+    syncTest("sync test")
+    {
+        check(1 + 1 == 2);
+    });
+    asyncTest("async test")
+    {
+        loop.schedCall([&]()
+        {
+            test.done();
+        }, 10);
+    });
+});
@@ -0,0 +1,92 @@
+/** Examples of the options that control the test run. Each group is run by its own target in
+ * the Makefile, with the options it demonstrates, and the target checks what the framework
+ * outputs. Options of the example itself, which change the behavior of some tests, are given
+ * after the framework's ones:
+ *  --slow  the 'slower' baseline test takes longer, so that it regresses
+ */
+#include "asyncTest.hpp"
+#include <thread>
+#include <string.h>
+
+TESTS_INIT();
+
+static bool hasArg(int argc, char** argv, const char* name)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char** argv)
+{
+    test::gOptions.parse(argc, argv);
+    const bool slow = hasArg(argc, argv, "--slow");
+    TestGroup("baseline")
+    {
+        syncTest("steady")
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        });
+        syncTest("slower")
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(slow ? 30 : 5));
+        });
+    });
+    TestGroup("durations")
+    {
+        //shortest-first, so that running them longest-first changes the order
+        std::vector<int> sleepMs{10, 20, 30, 40, 50, 60};
+        paramTest("sleep", sleepMs)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(param));
+        });
+    });
+    TestGroup("repeat")
+    {
+        syncTest("flaky")
+        {
+            checkNe(rand() % 4, 0); //rand() is seeded by the seed of the test run
+        });
+        syncTest("stable")
+        {
+            checkEq(1 + 1, 2);
+        });
+    });
+    TestGroup("trace")
+    {
+        asyncTest("async", {"reply"})
+        {
+            loop.schedCall([&test]() { test.done("reply"); }, 10);
+        });
+        syncTest("sync")
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        });
+    });
+    TestGroup("perf counters")
+    {
+        syncTest("sum")
+        {
+            std::vector<int> values(100000, 1);
+            volatile long sum = 0;
+            for (auto val: values)
+                sum = sum + val;
+            checkEq((long)sum, 100000L);
+        });
+        stressTest("stress", 2, 1000)
+        {
+            volatile int val = 0;
+            val = val + (int)iteration;
+        });
+        syncTest("instruction limit")
+        {
+            volatile long sum = 0;
+            for (int i = 0; i < 100000; i++)
+                sum = sum + i;
+        }).maxCounter(test::PerfCounters::kInstructions, 1000);
+    });
+    return test::gNumFailed;
+}
@@ -0,0 +1,39 @@
+/** Sync tests that hang, and are failed by the watchdog. A hang terminates the run, unless the
+ * tests run in worker processes (--jobs=N), where only the hung test's worker is terminated.
+ * The sleeping hang is interrupted by the signal that dumps the backtraces, and must still
+ * be reported as a timeout, rather than passing. See the run-timeout target in the Makefile
+ */
+#include "asyncTest.hpp"
+#include <unistd.h>
+
+TESTS_INIT();
+
+int main(int argc, char** argv)
+{
+    test::gOptions.parse(argc, argv);
+    TestGroup("sleeping hang")
+    {
+        syncTest("sleep hang")
+        {
+            sleep(5);
+        }).timeout(200);
+        syncTest("after sleep hang")
+        {
+            check(true);
+        });
+    });
+    TestGroup("spinning hang")
+    {
+        syncTest("spin hang")
+        {
+            volatile unsigned long count = 0;
+            for (;;)
+                count = count + 1;
+        }).timeout(200);
+        syncTest("after spin hang")
+        {
+            check(true);
+        });
+    });
+    return test::gNumFailed;
+}
@@ -9,6 +9,7 @@
 #include <vector>
 #include <string>
 #include <functional>
+#include "asyncTestConfig.hpp"
 namespace test
 {
 //need to declare the color vars before including the event loop header
@@ -19,17 +20,42 @@ extern const char* kColorNormal;
 extern const char* kColorWarning;
 }
 #define TEST_HAVE_COLOR_VARS
+#include "trace.hpp"
+#define TESTLOOP_TRACE_SCOPE(cat, name) test::TraceScope _traceScope(cat, name)
+#define TESTLOOP_TRACE_SCOPE_AT(cat, name, loc) test::TraceScope _traceScope(cat, name, loc)
+#define TESTLOOP_TRACE_INSTANT(cat, name) \
+    do { if (test::gTracer.isEnabled()) test::gTracer.instant(name, cat); } while(0)
 #include "eventLoop.hpp"
+#include "options.hpp"
+#include "perfBaseline.hpp"
+#include "scheduler.hpp"
+#include "workerPool.hpp"
+#include "perfCounters.hpp"
+#include "watchdog.hpp"
+#include "crashHandler.hpp"
+#include "timeReport.hpp"
+#include <time.h>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <sstream>
+#ifdef __linux__
+    #include <pthread.h>
+    #include <sched.h>
+#endif
 
 #define TEST_LOG_NO_EOL(fmtString,...) printf(fmtString, ##__VA_ARGS__)
 #define TEST_LOG(fmtString,...) TEST_LOG_NO_EOL(fmtString "\n", ##__VA_ARGS__)
 
-
+#if defined(ASYNCTEST_SEPARATE_COMPILATION) && !defined(ASYNCTEST_IMPLEMENTATION)
+    #define TESTS_INIT() //the globals are defined in the library
+#else
 #define TESTS_INIT() \
 namespace test { \
     unsigned gNumFailed = 0;          \
     unsigned gNumTests = 0;           \
     unsigned gNumDisabled = 0;        \
+    unsigned gNumSkipped = 0;         \
     unsigned gNumTestGroups = 0;      \
     Ts gTotalExecTime = 0;            \
     const char* kColorTag = "";       \
@@ -38,12 +64,18 @@ namespace test { \
     const char* kColorNormal = "";    \
     const char* kColorWarning = "";   \
     int gDefaultDoneTimeout = 2000;   \
+    Options gOptions;                 \
+    PerfBaseline gPerfBaseline(gOptions); \
+    TestScheduler gScheduler(gOptions); \
+    Tracer gTracer(gOptions);         \
+    TimeReport gTimeReport(gOptions); \
     struct TestInitializer {          \
-        TestInitializer() { srand(time(nullptr)); Test::initColors(); }    \
-        ~TestInitializer() { Test::printTotals(); } \
+        TestInitializer() { srand(time(nullptr)); Test::initColors(); gOptions.parseEnv(); } \
+        ~TestInitializer() { gPerfBaseline.save(); gScheduler.save(); gTracer.save(); gTimeReport.print(); Test::printTotals(); } \
     };                                               \
     TestInitializer _gsTestInit;                     \
 }
+#endif
 
 namespace test
 {
@@ -62,8 +94,13 @@ struct BailoutException: public std::runtime_error
 extern unsigned gNumFailed;
 extern unsigned gNumTests;
 extern unsigned gNumDisabled;
+extern unsigned gNumSkipped; //tests not selected by --filter or --shard
 extern unsigned gNumTestGroups;
 extern Ts gTotalExecTime;
+extern Options gOptions;
+extern PerfBaseline gPerfBaseline;
+extern TestScheduler gScheduler;
+extern TimeReport gTimeReport;
 
 //get function/lambda return type, regardless of argument count and types
 template <class F>
@@ -83,90 +120,308 @@ class ITestBody
 {
 public:
     virtual void call() = 0;
+/** Async tests: creates the event loop of the test, just before it is run */
+    virtual EventLoop* createLoop() { return nullptr; }
+    virtual bool isAsync() const { return false; }
     virtual ~ITestBody(){}
 };
 
-class Test
+/** Stores the names of the tests of a group in large chunks, instead of a separate heap
+ * block per name. The strings are never freed individually, only with the whole pool */
+class StringPool
+{
+protected:
+    enum { kChunkSize = 64 * 1024 };
+    std::vector<std::unique_ptr<char[]> > mChunks;
+    char* mPos = nullptr;
+    size_t mFree = 0;
+public:
+    const char* add(const char* str, size_t len)
+    {
+        if (len >= mFree)
+        {
+            if (len >= kChunkSize / 16) //a long string - don't discard the rest of the current chunk
+            {
+                mChunks.emplace_back(new char[len + 1]);
+                memcpy(mChunks.back().get(), str, len + 1);
+                return mChunks.back().get();
+            }
+            mChunks.emplace_back(new char[kChunkSize]);
+            mPos = mChunks.back().get();
+            mFree = kChunkSize;
+        }
+        char* result = mPos;
+        memcpy(result, str, len);
+        result[len] = 0;
+        mPos += len + 1;
+        mFree -= len + 1;
+        return result;
+    }
+    const char* add(const std::string& str) { return add(str.c_str(), str.size()); }
+};
+
+/** The name of a test. The names of the tests added to a group are in the string pool of
+ * the group, while the tests that are created on the fly, i.e. the cases of param tests,
+ * own a copy of their name */
+class TestName
+{
+protected:
+    const char* mStr;
+    std::unique_ptr<char[]> mOwned;
+    struct Pooled {};
+    TestName(const char* str, Pooled): mStr(str) {}
+    void copy(const char* str, size_t len)
+    {
+        mOwned.reset(new char[len + 1]);
+        memcpy(mOwned.get(), str, len + 1);
+        mStr = mOwned.get();
+    }
+public:
+    TestName(const std::string& str) { copy(str.c_str(), str.size()); }
+    TestName(const char* str) { copy(str, strlen(str)); }
+/** A name that is stored in a string pool, which has to outlive it */
+    static TestName pooled(const char* str) { return TestName(str, Pooled()); }
+    const char* c_str() const { return mStr; }
+    size_t size() const { return strlen(mStr); }
+    bool empty() const { return !*mStr; }
+    operator std::string() const { return mStr; }
+    bool operator==(const std::string& other) const { return other == mStr; }
+};
+inline std::string operator+(const std::string& a, const TestName& b) { return a + b.c_str(); }
+inline std::string operator+(const char* a, const TestName& b) { return a + std::string(b.c_str()); }
+
+/** The failures of the non-fatal expect() checks of a test, grouped by the check that failed */
+class ExpectLog
+{
+public:
+    enum { kMaxSamplesPerCheck = 3 };
+    struct Failure
+    {
+        const char* where; //the check and its location - a string literal, so compared by pointer
+        size_t count;
+        std::vector<std::string> samples; //the operand values of the first failures
+    };
+    std::vector<Failure> failures;
+    size_t numFailures = 0;
+    size_t numSamples = 0;
+    void add(const char* where, std::string&& details)
+    {
+        numFailures++;
+        auto it = std::find_if(failures.begin(), failures.end(),
+            [where](const Failure& f) { return f.where == where; });
+        if (it == failures.end())
+        {
+            failures.push_back(Failure{where, 0, std::vector<std::string>()});
+            it = failures.end() - 1;
+        }
+        it->count++;
+        if (!details.empty() && it->samples.size() < kMaxSamplesPerCheck)
+        {
+            it->samples.push_back(std::move(details));
+            numSamples++;
+        }
+    }
+    std::string summary() const
+    {
+        std::string result = std::to_string(numFailures) + " failure" + ((numFailures == 1) ? "" : "s")
+            + " of " + std::to_string(failures.size()) + " check" + ((failures.size() == 1) ? "" : "s");
+        for (auto& f: failures)
+        {
+            result.append("\n* * * [").append(std::to_string(f.count)).append("x] ").append(f.where);
+            for (auto& sample: f.samples)
+                result.append("\n* * *     ").append(sample);
+            if (f.count > f.samples.size() && !f.samples.empty())
+                result.append("\n* * *     ...");
+        }
+        return result;
+    }
+};
+
+/** The state of a test that is needed only while it runs and while its result is reported.
+ * It is created when the test is executed, and released once the result has been reported,
+ * so that the registered tests of a large suite don't each hold it */
+struct TestRunState
 {
     std::function<void()> cleanup;
+/** Failures of expect() checks, allocated on the first one */
+    std::unique_ptr<ExpectLog> expectLog;
+    std::string errorMsg;
+    Ts execTime = 0;
+    double cpuTime = 0; //process CPU time during the test body, in milliseconds
+/** Time breakdown, for the time report: the before-each handler, the cleanup and after-each
+ * handlers, and the part of execTime the event loop spent waiting. For sync tests, the
+ * wait time is the part of execTime that is not CPU time */
+    Ts setupTime = 0;
+    Ts teardownTime = 0;
+    Ts waitTime = 0;
+/** Custom metrics reported by the test via metric(), i.e. benchmark ns/op.
+ * These are compared against the performance baseline, same as execTime and cpuTime */
+    std::vector<std::pair<std::string, double> > metrics;
+/** Hardware performance counters during the test body, if measured */
+    PerfCounters::Values counters;
+};
+
+class Test
+{
+/** If non-negative, completeOnDones() was called, with this grace period */
+    int mCompleteGraceMs = -1;
+/** Timeout of a sync test, set by timeout(). If negative, --sync-timeout applies */
+    int mTimeoutMs = -1;
+/** Delay of the start of the body of an async test, set by startDelay(). If negative, the
+ * default delay of schedCall() applies */
+    int mStartDelayMs = -1;
+/** Limits of the hardware counters, set via maxCounter() and minIpc(). A counter index
+ * of -1 means a minimum of the instructions per cycle. Allocated on the first limit */
+    std::unique_ptr<std::vector<std::pair<int, double> > > mCounterLimits;
+/** Exists from the execution of the test until its result is reported, see state() */
+    std::unique_ptr<TestRunState> mState;
+    void addCounterLimit(int counter, double value)
+    {
+        if (!mCounterLimits)
+            mCounterLimits.reset(new std::vector<std::pair<int, double> >);
+        mCounterLimits->emplace_back(counter, value);
+    }
 public:
     TestGroup& group;
-    std::string name;
+    TestName name;
     std::unique_ptr<ITestBody> body;
-    std::string errorMsg;
-    Ts execTime = 0;
+/** The event loop of an async test. Loops created via addAsyncTest(), i.e. by the asyncTest()
+ * macro, exist only while the test is executed */
     std::unique_ptr<EventLoop> loop;
     bool isDisabled = false;
+    bool threadsPinned = false; //stress tests: pin each thread to a separate CPU
+/** The seed of the random generators during the test - the jitter of the event loop and rand() */
+    unsigned seed = 0;
 //===
     constexpr static const char* kLine =     "====================================================";
     constexpr static const char* kThinLine = "----------------------------------------------------";
 
     template<class CB>
-    inline Test(TestGroup& parent, const std::string& aName, CB&& aBody, EventLoop* aLoop=nullptr);
-    void error(const std::string& msg)
+    inline Test(TestGroup& parent, TestName&& aName, CB&& aBody, EventLoop* aLoop=nullptr);
+/** Creates a test without a body, which has to be set by the caller */
+    inline Test(TestGroup& parent, TestName&& aName);
+/** If set for the current thread, errors are stored there instead of failing the test.
+ * Used by property checks, which evaluate the same check() many times */
+    static std::string*& errorCapture()
     {
-        if (!errorMsg.empty())
-            return;
-        gNumFailed++;
-        errorMsg = kColorFail;
-        errorMsg.append("fail").append(kColorNormal)
-                .append(kColorTag).append(" '").append(name).append(kColorNormal)
-                .append("' (").append(std::to_string(execTime)).append(" ms)")
-                .append("\n* * * ").append(msg);
-        TEST_LOG("%s", errorMsg.c_str());
-        if (loop)
-            loop->abort();
+        static thread_local std::string* sCapture = nullptr;
+        return sCapture;
     }
-    template <class...Args>
-    void done(Args... args) { loop->done(args...); }
-
-    inline void run();
-    inline Test& disable();
-    bool hasError() const { return !errorMsg.empty(); }
-    static void printTotals()
+/** The result, times and metrics of the current execution of the test. Created on first
+ * use if the test is not being executed, i.e. when its result comes from a worker process */
+    TestRunState& state()
     {
-        TEST_LOG("%s", kLine);
-        if (!gNumFailed)
-            TEST_LOG("All %d tests in %d groups %spassed%s (%lld ms)",
-                gNumTests-gNumDisabled, gNumTestGroups, kColorSuccess, kColorNormal, gTotalExecTime);
-        else
-            TEST_LOG("Some tests failed: %d %sfailed%s / %d total in %d group%s (%lld ms)",
-                gNumFailed, kColorFail, kColorNormal, gNumTests-gNumDisabled,
-                gNumTestGroups, (gNumTestGroups==1)?"":"s", gTotalExecTime);
-        if (gNumDisabled)
-            TEST_LOG("(%d tests DISABLED)", gNumDisabled);
-        TEST_LOG("%s", kLine);
+        if (!mState)
+            mState.reset(new TestRunState);
+        return *mState;
+    }
+/** Releases the state of the execution, once its result has been reported */
+    void releaseState() { mState.reset(); }
+    void error(const std::string& msg);
+/** Records a failure of a non-fatal expect() check, which doesn't stop the test. The test fails
+ * when it completes, with a summary of the failures, grouped by check.
+ * @param where Describes the check and its location. Must be a string literal
+ * @param details The values of the operands, or an empty string */
+    void expectFailed(const char* where, std::string&& details);
+/** Whether the values of a failed expect() check are still recorded, see --expect-limit */
+    bool expectWantsDetails() const
+    {
+        return !mState || !mState->expectLog || mState->expectLog->numSamples < gOptions.expectLimit;
+    }
+/** Fails the test if any expect() checks failed */
+    void flushExpectations();
+    void done(SrcLoc loc=ASYNCTEST_CALLER_LOC) { loop->done("_default", loc); }
+    void done(const std::string& tag, SrcLoc loc=ASYNCTEST_CALLER_LOC) { loop->done(tag, loc); }
+/** Reports a custom performance metric of the test. Lower values are considered better */
+    void metric(const std::string& metricName, double value)
+    {
+        state().metrics.emplace_back(metricName, value);
     }
+    std::string fullName() const;
+    void checkPerformance();
+/** Runs the test and reports the result */
+    void run()
+    {
+        initSeed();
+        execute();
+        finish();
+    }
+/** Selects the random seed for the next execution of the test */
+    void initSeed()
+    {
+        seed = (gOptions.seed >= 0) ? (unsigned)gOptions.seed : (unsigned)rand();
+    }
+/** Runs the test body, together with the before-each, cleanup and after-each handlers */
+    void execute();
+/** Does the part of the result reporting that has to be done in the main process, after the
+ * test has been executed, possibly in a worker process */
+    void finish();
+    std::string serializeResult();
+    void applyResult(WorkerPool::Completion& completion);
+    Test& disable();
+/** Fails the test if the hardware counter exceeds \c maxValue during the test body.
+ * Enables the measurement of the counters for this test, even without --perf-counters.
+ * If the counters are not available, the limit is not checked */
+    Test& maxCounter(PerfCounters::Counter counter, double maxValue)
+    {
+        addCounterLimit(counter, maxValue);
+        return *this;
+    }
+/** Fails the test if its instructions per cycle are below \c value. See maxCounter() */
+    Test& minIpc(double value)
+    {
+        addCounterLimit(-1, value);
+        return *this;
+    }
+    bool measuresCounters() const { return gOptions.perfCounters || mCounterLimits; }
+/** Checks whether the hardware counters can be used, and if not, warns once why */
+    static bool countersAvailable()
+    {
+        static int sAvailable = -1;
+        if (sAvailable < 0)
+        {
+            auto& pc = PerfCounters::forThread();
+            sAvailable = pc.isOpen();
+            if (!sAvailable)
+                TEST_LOG("%sWARNING%s: Hardware performance counters not available (%s), not measuring",
+                    kColorWarning, kColorNormal, pc.error().c_str());
+        }
+        return sAvailable;
+    }
+    void checkCounters();
+/** Sets the timeout of a synchronous or stress test, overriding --sync-timeout. Zero means
+ * no timeout. The timeouts of async tests are the ones of their done() items */
+    Test& timeout(int ms) { mTimeoutMs = ms; return *this; }
+    int syncTimeout() const { return (mTimeoutMs >= 0) ? mTimeoutMs : gOptions.syncTimeoutMs; }
+/** Called by the watchdog when a sync test doesn't complete within its timeout */
+    static void onTimeout(void* test);
+/** Writes a summary of the test run so far from the crash handler. Async-signal-safe */
+    static void writeCrashSummary(int fd);
+/** Stress tests only: pins each thread to a separate CPU core, to make the results repeatable */
+    Test& pinThreads() { threadsPinned = true; return *this; }
+/** Makes the async test complete as soon as all its done() items are resolved, cancelling
+ * the pending scheduled calls, except the ones due within \c graceMs */
+    Test& completeOnDones(int graceMs=0);
+/** Sets the delay, in ms, after which the body of an async test is called, once its loop
+ * runs. By default, the body is scheduled like any other call with the default delay - after
+ * 100 ms, with the loop's jitter. An explicit delay has no jitter, so 0 starts it immediately */
+    Test& startDelay(int ms) { mStartDelayMs = ms; return *this; }
+    bool hasError() const { return mState && !mState->errorMsg.empty(); }
+    bool isAsync() const { return loop || (body && body->isAsync()); }
+    static void printTotals();
     static inline Ts getTimeMs()
     {
         return std::chrono::duration_cast<std::chrono::milliseconds>(
             std::chrono::system_clock::now().time_since_epoch()).count();
     }
-    static void initColors()
+    static inline double getCpuTimeMs()
     {
-        if (!isatty(1))
-            return;
-        kColorSuccess = "\033[1;32m";
-        kColorFail = "\033[1;31m";
-        kColorNormal = "\033[0m";
-        kColorTag = "\033[34m";
-        kColorWarning = "\033[33m";
+        timespec ts;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
     }
-    void doCleanup()
-	{
-        if (!cleanup)
-            return;
-		try
-		{
-            cleanup();
-		}
-        catch (BailoutException& e)
-        {  error(std::string("Error during cleanup: ") + e.what());  }
-		catch(std::exception& e)
-        {  error(std::string("Exception during cleanup: ") + e.what());  }
-		catch(...)
-        {  error("Non-standard exception during cleanup");  }
-	}
+    static void initColors();
+    void doCleanup();
 };
 
 template <class CB>
@@ -186,13 +441,293 @@ public:
     virtual void call(){ doCall(); }
 };
 
+/** The body of an async test whose event loop is created by a factory function when the
+ * test is run, rather than when it is added, see TestGroup::addAsyncTest() */
+template <class CB, class F>
+class AsyncTestBody: public TestBody<CB>
+{
+protected:
+    F mLoopFactory;
+public:
+    AsyncTestBody(Test& aTest, CB&& cb, F&& loopFactory)
+    : TestBody<CB>(aTest, std::forward<CB>(cb)), mLoopFactory(std::forward<F>(loopFactory)) {}
+    virtual EventLoop* createLoop() { return mLoopFactory(); }
+    virtual bool isAsync() const { return true; }
+};
+
 template <class CB>
-Test::Test(TestGroup& parent, const std::string& aName, CB&& aBody, EventLoop* aLoop)
-    :group(parent), name(aName), body(new TestBody<CB>(*this, std::forward<CB>(aBody))),
+Test::Test(TestGroup& parent, TestName&& aName, CB&& aBody, EventLoop* aLoop)
+    :group(parent), name(std::move(aName)), body(new TestBody<CB>(*this, std::forward<CB>(aBody))),
      loop(aLoop)
 {
     gNumTests++;
 }
+Test::Test(TestGroup& parent, TestName&& aName)
+    :group(parent), name(std::move(aName))
+{
+    gNumTests++;
+}
+
+/** The context of one thread of a stress test. It is passed to the test body as \c test,
+ * so that check() and error() in the body report the thread and the iteration */
+class StressThread
+{
+protected:
+    std::mutex& mMutex;
+    std::atomic<bool>& mFailed;
+public:
+    Test& parent;
+    unsigned index;
+    size_t iteration = 0;
+    StressThread(Test& aParent, unsigned aIndex, std::mutex& mutex, std::atomic<bool>& failed)
+    : mMutex(mutex), mFailed(failed), parent(aParent), index(aIndex) {}
+    std::string context() const
+    {
+        return "[thread "+std::to_string(index)+", iteration "+std::to_string(iteration)+"] ";
+    }
+/** Records an error in the test and makes all threads stop */
+    void error(const std::string& msg)
+    {
+        mFailed.store(true, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(mMutex);
+        parent.error(context()+msg);
+    }
+/** Records a failure of an expect() check, without stopping the threads */
+    void expectFailed(const char* where, std::string&& details)
+    {
+        if (!details.empty())
+            details.insert(0, context());
+        std::lock_guard<std::mutex> lock(mMutex);
+        parent.expectFailed(where, std::move(details));
+    }
+    bool expectWantsDetails() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return parent.expectWantsDetails();
+    }
+};
+
+/** Runs the body of a stress test the specified number of iterations on each of the
+ * specified number of threads. The threads are started together via a spin barrier,
+ * and the aggregate throughput is reported as the "ns/op" metric of the test. If the
+ * hardware counters are measured, the counters of all threads are added up, and are also
+ * reported per operation
+ */
+template <class CB>
+class StressTestBody: public ITestBody
+{
+protected:
+    Test& mTest;
+    CB mCb;
+    unsigned mNumThreads;
+    size_t mIterations;
+    static void pinToCpu(unsigned idx)
+    {
+#ifdef __linux__
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(idx % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+    }
+public:
+    StressTestBody(Test& aTest, CB&& cb, unsigned numThreads, size_t iterations)
+    : mTest(aTest), mCb(std::forward<CB>(cb)), mNumThreads(numThreads ? numThreads : 1),
+      mIterations(iterations) {}
+    virtual void call()
+    {
+        typedef std::chrono::steady_clock Clock;
+        std::mutex mutex;
+        std::atomic<bool> failed(false);
+        std::atomic<unsigned> numReady(0);
+        std::atomic<bool> go(false);
+        std::vector<Clock::duration> threadTimes(mNumThreads);
+        std::vector<PerfCounters::Values> threadCounters(mNumThreads);
+        bool measureCounters = mTest.measuresCounters() && Test::countersAvailable();
+        std::vector<std::thread> threads;
+        threads.reserve(mNumThreads);
+        for (unsigned i = 0; i < mNumThreads; i++)
+        {
+            threads.emplace_back([&, i]()
+            {
+                CrashHandler::ThreadAltStack altStack;
+                if (mTest.threadsPinned)
+                    pinToCpu(i);
+                StressThread ctx(mTest, i, mutex, failed);
+                numReady.fetch_add(1);
+                PerfCounters::Values countersStart;
+                if (measureCounters)
+                    PerfCounters::forThread(); //open the counters before the barrier
+                while (!go.load(std::memory_order_acquire)); //spin barrier
+                if (measureCounters)
+                    countersStart = PerfCounters::forThread().read();
+                auto start = Clock::now();
+                try
+                {
+                    for (size_t& iter = ctx.iteration; iter < mIterations; iter++)
+                    {
+                        if (failed.load(std::memory_order_relaxed))
+                            break;
+                        mCb(ctx, iter);
+                    }
+                }
+                catch(BailoutException&) {} //error already recorded
+                catch(std::exception& e)
+                {  ctx.error(std::string("Exception: ")+e.what());  }
+                catch(...)
+                {  ctx.error("Non-standard exception");  }
+                threadTimes[i] = Clock::now() - start;
+                if (measureCounters)
+                    threadCounters[i] = PerfCounters::forThread().read() - countersStart;
+            });
+        }
+        while (numReady.load() < mNumThreads)
+            std::this_thread::yield();
+        auto start = Clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto& thread: threads)
+            thread.join();
+        double elapsedNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        if (failed)
+            throw BailoutException("stress test failed");
+        auto minmax = std::minmax_element(threadTimes.begin(), threadTimes.end());
+        double ops = (double)mNumThreads * mIterations;
+        double nsPerOp = ops ? elapsedNs / ops : 0;
+        TEST_LOG("  %u thread%s x %zu iterations: %.3f Mops/s (%.1f ns/op), thread time %.1f..%.1f ms",
+            mNumThreads, (mNumThreads == 1) ? "" : "s", mIterations, nsPerOp ? 1000 / nsPerOp : 0.0,
+            nsPerOp, std::chrono::duration<double, std::milli>(*minmax.first).count(),
+            std::chrono::duration<double, std::milli>(*minmax.second).count());
+        mTest.metric("ns/op", nsPerOp);
+        PerfCounters::Values counters;
+        for (auto& thread: threadCounters)
+            counters.add(thread);
+        if (counters.valid())
+        {
+            TEST_LOG("  per op: %s", (counters / ops).format().c_str());
+            mTest.state().counters.add(counters);
+        }
+    }
+};
+
+/** A parameterized test - a test body that is run once for each of a sequence of parameters.
+ * The cases are created on demand, when the runner reaches them, and are destroyed after they
+ * complete, so that a large sweep doesn't have to be in memory at once. Each case is a
+ * separate test named <name>/<parameter index>, so it can be selected by --filter and is
+ * distributed among shards and worker processes individually
+ */
+class ParamTest
+{
+protected:
+    TestGroup& mGroup;
+    virtual std::shared_ptr<Test> doMakeCase(size_t idx) = 0;
+    template <class CB, class P>
+    static typename std::enable_if<FuncTraits<CB>::nargs == 2, Test*>::type
+    newCase(TestGroup& group, std::string&& name, const std::shared_ptr<CB>& cb, P&& param)
+    {
+        return new Test(group, std::move(name), [cb, param](Test& test)
+        {  (*cb)(test, param);  });
+    }
+    template <class CB, class P>
+    static typename std::enable_if<FuncTraits<CB>::nargs == 3, Test*>::type
+    newCase(TestGroup& group, std::string&& name, const std::shared_ptr<CB>& cb, P&& param)
+    {
+        auto test = new Test(group, std::move(name));
+        auto body = [cb, param](Test& test, EventLoop& loop) {  (*cb)(test, loop, param);  };
+        auto loopFactory = []() { return new EventLoop(); };
+        test->body.reset(new AsyncTestBody<decltype(body), decltype(loopFactory)>(
+            *test, std::move(body), std::move(loopFactory)));
+        return test;
+    }
+public:
+    std::string name;
+    size_t numCases;
+    bool isDisabled = false;
+/** The number of plain tests of the group that were added before this one, to run the tests
+ * in the order in which they were added */
+    size_t position = 0;
+    ParamTest(TestGroup& group, std::string&& aName, size_t count)
+    : mGroup(group), name(std::move(aName)), numCases(count)
+    {
+        gNumTests += numCases;
+    }
+    virtual ~ParamTest() {}
+    std::string caseName(size_t idx) const { return name + "/" + std::to_string(idx); }
+/** Creates the test case for the parameter with the specified index */
+    std::shared_ptr<Test> makeCase(size_t idx)
+    {
+        auto test = doMakeCase(idx);
+        gNumTests--; //the cases were counted when the param test was added
+        return test;
+    }
+    ParamTest& disable();
+};
+
+/** Parameterized test over a range, i.e. a container. Access to the parameters is sequential
+ * if the range doesn't have random access iterators, which is efficient as long as the
+ * cases are created in index order, as is the case unless tests are run in parallel */
+template <class R, class CB>
+class RangeParamTest: public ParamTest
+{
+protected:
+    typedef typename std::decay<R>::type Range;
+    typedef decltype(std::begin(std::declval<Range&>())) Iter;
+    Range mRange;
+    std::shared_ptr<CB> mCb;
+    Iter mIter;
+    size_t mPos = 0;
+    virtual std::shared_ptr<Test> doMakeCase(size_t idx)
+    {
+        if (idx < mPos)
+        {
+            mIter = std::begin(mRange);
+            mPos = 0;
+        }
+        std::advance(mIter, idx - mPos);
+        mPos = idx;
+        return std::shared_ptr<Test>(newCase(mGroup, caseName(idx), mCb, *mIter));
+    }
+public:
+    RangeParamTest(TestGroup& group, std::string&& aName, R&& range, CB&& cb)
+    : ParamTest(group, std::move(aName), std::distance(std::begin(range), std::end(range))),
+      mRange(std::forward<R>(range)), mCb(std::make_shared<CB>(std::forward<CB>(cb))),
+      mIter(std::begin(mRange))
+    {}
+};
+
+/** Parameterized test whose parameters are generated by a function of the parameter index */
+template <class G, class CB>
+class GenParamTest: public ParamTest
+{
+protected:
+    typename std::decay<G>::type mGen; //a copy, as the group body's variable is gone when the cases run
+    std::shared_ptr<CB> mCb;
+    virtual std::shared_ptr<Test> doMakeCase(size_t idx)
+    {
+        return std::shared_ptr<Test>(newCase(mGroup, caseName(idx), mCb, mGen(idx)));
+    }
+public:
+    GenParamTest(TestGroup& group, std::string&& aName, size_t count, G&& gen, CB&& cb)
+    : ParamTest(group, std::move(aName), count), mGen(std::forward<G>(gen)),
+      mCb(std::make_shared<CB>(std::forward<CB>(cb)))
+    {}
+};
+/** The parameter types of range and generator param tests, used by the paramTest macros */
+template <class R>
+struct RangeParamOf
+{  typedef typename std::decay<decltype(*std::begin(std::declval<R&>()))>::type type;  };
+template <class G>
+struct GenParamOf
+{  typedef typename std::decay<decltype(std::declval<G&>()(size_t(0)))>::type type;  };
+
+/** A test scheduled to run - either a plain test, or a case of a param test, which is
+ * created only when it is about to run */
+struct PlannedTest
+{
+    std::shared_ptr<Test> test;
+    ParamTest* paramTest = nullptr;
+    size_t index = 0;
+    std::shared_ptr<Test> get() const { return paramTest ? paramTest->makeCase(index) : test; }
+};
 
 class TestGroup
 {
@@ -201,10 +736,14 @@ public:
 	std::string name;
     std::string errorMsg;
 	TestList tests;
+    std::vector<std::unique_ptr<ParamTest> > paramTests;
+/** The names of the tests, in order to not allocate each one separately */
+    StringPool names;
     unsigned numErrors = 0;
     unsigned numDisabled = 0;
     unsigned numTests = 0;
     Ts execTime = 0;
+    Ts wallTime = 0; //set only when the tests are run in parallel
     std::function<void(Test&)> beforeEach;
     std::function<void(Test&)> afterEach;
     std::function<void()> allCleanup;
@@ -214,9 +753,57 @@ public:
     Test& addTest(std::string&& name, EventLoop* aLoop, CB&& lambda)
 	{
         tests.emplace_back(std::make_shared<Test>(
-            *this, std::forward<std::string>(name), std::forward<CB>(lambda), aLoop));
+            *this, TestName::pooled(names.add(name)), std::forward<CB>(lambda), aLoop));
         return *tests.back();
 	}
+/** Adds an async test whose event loop is created by calling \c loopFactory just before the
+ * test is run, and is destroyed as soon as it completes, so that the tests that are waiting
+ * to run don't hold a loop each */
+    template <class F, class CB>
+    Test& addAsyncTest(std::string&& name, F&& loopFactory, CB&& lambda)
+    {
+        auto test = std::make_shared<Test>(*this, TestName::pooled(names.add(name)));
+        test->body.reset(new AsyncTestBody<CB, F>(*test, std::forward<CB>(lambda),
+            std::forward<F>(loopFactory)));
+        tests.push_back(test);
+        return *test;
+    }
+    template <class CB>
+    Test& addStressTest(std::string&& name, unsigned numThreads, size_t iterations, CB&& lambda)
+    {
+        auto test = std::make_shared<Test>(*this, TestName::pooled(names.add(name)));
+        test->body.reset(new StressTestBody<CB>(*test, std::forward<CB>(lambda), numThreads, iterations));
+        tests.push_back(test);
+        return *test;
+    }
+/** Adds a parameterized test over a range of parameters. The range is stored in the test,
+ * by value. The lambda takes the parameter as a last argument, after the test (and the
+ * event loop, for async tests) */
+    template <class R, class CB>
+    ParamTest& addParamTest(std::string&& name, R&& params, CB&& lambda)
+    {
+        paramTests.emplace_back(new RangeParamTest<R, CB>(*this, std::move(name),
+            std::forward<R>(params), std::forward<CB>(lambda)));
+        paramTests.back()->position = tests.size();
+        return *paramTests.back();
+    }
+/** Adds a parameterized test with \c count parameters, generated by calling \c gen
+ * with the index of the parameter */
+    template <class G, class CB>
+    ParamTest& addParamTest(std::string&& name, size_t count, G&& gen, CB&& lambda)
+    {
+        paramTests.emplace_back(new GenParamTest<G, CB>(*this, std::move(name), count,
+            std::forward<G>(gen), std::forward<CB>(lambda)));
+        paramTests.back()->position = tests.size();
+        return *paramTests.back();
+    }
+    size_t numTotalTests() const
+    {
+        size_t count = tests.size();
+        for (auto& param: paramTests)
+            count += param->numCases;
+        return count;
+    }
     template <class CB>
     TestGroup(const std::string& aName, CB&& aBody)
         :name(aName), body(std::forward<CB>(aBody))
@@ -224,128 +811,408 @@ public:
         gNumTestGroups++;
         run();
     }
-    void run()
-	{
-        TEST_LOG("%s", Test::kLine);
-		try
-		{
-            body(*this);
-            numTests = tests.size() - numDisabled;
-            TEST_LOG_NO_EOL("RUN   Group '%s%s%s' (%u test%s", kColorTag,
-                name.c_str(), kColorNormal, numTests, (numTests == 1) ? "" : "s");
-            if (numDisabled)
-            {
-                TEST_LOG_NO_EOL(", %d disabled", numDisabled);
-            }
-            TEST_LOG(")...\n%s", Test::kThinLine);
-		}
-        catch(BailoutException& e)
-        {
-            error(std::string("Error at test group setup: ")+e.what());
-            return;
-        }
-		catch(std::exception& e)
-		{
-            error(std::string("Exception during test group setup:")+e.what());
-			return;
-		}
-		catch(...)
-		{
-            error("Non-standard exception during test group setup");
-			return;
-		}
-        for (auto& test: tests)
-		{
-            if (test->isDisabled)
-            {
-                TEST_LOG("%sdis%s  '%s%s%s'\n%s", kColorWarning, kColorNormal,
-                    kColorTag, test->name.c_str(), kColorNormal, Test::kThinLine);
-                continue;
-            }
-            test->run();
-            TEST_LOG("%s", Test::kThinLine);
-            execTime += test->execTime;
-            if (test->hasError())
-            {
-                error(test->errorMsg);
-            }
-        }
-
-		if (allCleanup)
-        {
-            try
-            {
-                allCleanup();
-            }
-            catch(BailoutException& e)
-            { error(e.what()); }
-            catch(std::exception& e)
-            {  error(std::string("Exception in cleanup of test group: ")+e.what());  }
-            catch(...)
-            {  error("Non standard exception in cleanup of test group");  }
-        }
-        printSummary();
+    void run();
+/** Selects the tests of the current shard and the order in which to run them */
+    std::vector<PlannedTest> planTests();
+/** Runs the tests in worker processes, up to gOptions.numJobs() at a time */
+    void runParallel(const std::vector<PlannedTest>& planned);
+/** Repeat mode: runs the test many times in worker processes, each time with a different seed,
+ * and reports the failure rate and the failing seeds */
+    void runRepeated(Test& test);
+/** Executed in a worker process - runs the test and returns the serialized result */
+    static std::string executeInWorker(Test& test);
+/** Whether this is a worker process, forked to execute a single test */
+    static bool& isWorkerProcess()
+    {
+        static bool sIsWorker = false;
+        return sIsWorker;
     }
+    void onTestComplete(Test& test);
     bool hasError() const { return !errorMsg.empty(); }
-    void error(const std::string& msg)
+    void error(const std::string& msg);
+    void printSummary();
+
+};
+
+/** Test groups that register themselves at static initialization time, via the
+ * registerTestGroup() macro, so that they can be defined in any translation unit. They
+ * are run by runRegisteredGroups(), in the order of registration - which, for groups in
+ * different translation units, is the link order */
+class GroupRegistry
+{
+public:
+    struct Entry
     {
-        numErrors++;
-        if (hasError())
-            return;
-        errorMsg = msg;
-	}
-    void printSummary()
+        std::string name;
+        std::function<void(TestGroup&)> body;
+    };
+    static std::vector<Entry>& groups()
     {
-        if (!numErrors)
-        {
-            TEST_LOG("%sPASS%s  Group '%s%s%s': 0 errors / %u test%s (%lld ms)",
-                kColorSuccess, kColorNormal, kColorTag, name.c_str(), kColorNormal,
-                numTests, (numTests==1)?"":"s", execTime);
-        }
-        else
+        static std::vector<Entry> sGroups; //constructed on first use, in any static initializer
+        return sGroups;
+    }
+};
+struct GroupRegistrar
+{
+    GroupRegistrar(const char* name, std::function<void(TestGroup&)>&& body)
+    {
+        GroupRegistry::groups().push_back(GroupRegistry::Entry{name, std::move(body)});
+    }
+};
+/** Runs all groups registered via registerTestGroup().
+ * @returns The total number of failed tests so far */
+int runRegisteredGroups();
+
+/** Human-readable representation of a value, for failure messages. Can be specialized
+ * for user types that don't have an \c operator<< */
+template <class T>
+struct ValuePrinter
+{
+    template <class U>
+    static auto print(std::ostream& os, const U& val, int) -> decltype(os << val, void())
+    {  os << val;  }
+    template <class U>
+    static void print(std::ostream& os, const U&, long)
+    {  os << "<" << sizeof(U) << "-byte value>";  }
+    static void print(std::ostream& os, const T& val) { print(os, val, 0); }
+};
+template <>
+struct ValuePrinter<std::string>
+{
+    static void print(std::ostream& os, const std::string& val) { os << '"' << val << '"'; }
+};
+template <>
+struct ValuePrinter<char>
+{
+    static void print(std::ostream& os, char val) { os << '\'' << val << '\''; }
+};
+template <class T>
+struct ValuePrinter<std::vector<T> >
+{
+    static void print(std::ostream& os, const std::vector<T>& val)
+    {
+        os << '[';
+        for (size_t i = 0; i < val.size(); i++)
         {
-            TEST_LOG("%sFAIL%s  Group '%s%s%s': %u error%s / %u test%s (%lld ms)",
-                kColorFail, kColorNormal, kColorTag, name.c_str(), kColorNormal,
-                numErrors, (numErrors==1)?"":"s", numTests,
-                (numTests==1)?"":"s", execTime);
+            if (i)
+                os << ", ";
+            ValuePrinter<T>::print(os, val[i]);
         }
+        os << ']';
     }
-
 };
-//we need the complete definition of class TestGroup, so we defined run() outside the Test class
-void Test::run()
+
+namespace detail
+{
+/** Returns "<expr> = <value>", or an empty string if the expression is a literal of the value */
+template <class T>
+std::string describeOperand(const char* expr, const T& val)
+{
+    std::ostringstream os;
+    os.precision(17);
+    ValuePrinter<T>::print(os, val);
+    auto str = os.str();
+    return (str == expr) ? std::string() : (expr + (" = " + str));
+}
+template <class T>
+void printOperand(std::ostream& os, const char* expr, const T& val)
+{
+    auto str = describeOperand(expr, val);
+    if (!str.empty())
+        os << "\n* * *   " << str;
+}
+/** Scalars are passed to the failure path by value, so that the passing path doesn't
+ * have to store them in memory */
+template <class T>
+struct CheckArg
+{  typedef typename std::conditional<std::is_scalar<T>::value, T, const T&>::type type;  };
+
+/** The failure path of checkEq() and the other comparison checks. It is out of line and
+ * cold, so that a passing check is only a compare and a branch, and the values are
+ * formatted only on failure. \c test is a Test, or a StressThread */
+template <class T, class A, class B>
+[[noreturn]] ASYNCTEST_COLD void checkOpFail(T& test, const char* check, const char* exprA,
+    const char* exprB, typename CheckArg<A>::type a, typename CheckArg<B>::type b, const char* location)
+{
+    std::ostringstream os;
+    os << check << "(" << exprA << ", " << exprB << ") failed at " << location;
+    printOperand(os, exprA, a);
+    printOperand(os, exprB, b);
+    auto msg = os.str();
+    test.error(msg);
+    throw BailoutException(msg);
+}
+template <class T, class A, class B>
+[[noreturn]] inline void checkOpFailed(T& test, const char* check, const char* exprA,
+    const char* exprB, const A& a, const B& b, const char* location)
+{
+    checkOpFail<T, A, B>(test, check, exprA, exprB, a, b, location);
+}
+template <class T, class A, class B, class E>
+[[noreturn]] ASYNCTEST_COLD void checkNearFail(T& test, const char* exprA, const char* exprB,
+    const char* exprEps, typename CheckArg<A>::type a, typename CheckArg<B>::type b,
+    typename CheckArg<E>::type eps, const char* location)
+{
+    std::ostringstream os;
+    os.precision(17);
+    os << "checkNear(" << exprA << ", " << exprB << ", " << exprEps << ") failed at " << location;
+    printOperand(os, exprA, a);
+    printOperand(os, exprB, b);
+    os << "\n* * *   difference " << std::fabs(a - b) << " exceeds " << eps;
+    auto msg = os.str();
+    test.error(msg);
+    throw BailoutException(msg);
+}
+template <class T, class A, class B, class E>
+[[noreturn]] inline void checkNearFailed(T& test, const char* exprA, const char* exprB,
+    const char* exprEps, const A& a, const B& b, const E& eps, const char* location)
+{
+    checkNearFail<T, A, B, E>(test, exprA, exprB, exprEps, a, b, eps, location);
+}
+/** The failure path of expectEq() and the other comparison expectations. The operand
+ * values are formatted only while the test records them, see --expect-limit */
+template <class T, class A, class B>
+ASYNCTEST_COLD void expectOpFail(T& test, const char* where, const char* exprA, const char* exprB,
+    typename CheckArg<A>::type a, typename CheckArg<B>::type b)
+{
+    std::string details;
+    if (test.expectWantsDetails())
+    {
+        details = describeOperand(exprA, a);
+        auto descB = describeOperand(exprB, b);
+        if (!details.empty() && !descB.empty())
+            details.append(", ");
+        details.append(descB);
+    }
+    test.expectFailed(where, std::move(details));
+}
+template <class T, class A, class B>
+inline void expectOpFailed(T& test, const char* where, const char* exprA, const char* exprB,
+    const A& a, const B& b)
+{
+    expectOpFail<T, A, B>(test, where, exprA, exprB, a, b);
+}
+}
+
+#ifdef ASYNCTEST_COMPILE_IMPL
+//The non-template part of the runtime. In separate compilation mode, it is compiled only in the library
+ASYNCTEST_INLINE void Test::error(const std::string& msg)
+{
+    if (auto capture = errorCapture())
+    {
+        if (capture->empty())
+            *capture = msg;
+        return;
+    }
+    auto& st = state();
+    if (!st.errorMsg.empty())
+        return;
+    gNumFailed++;
+    std::string expectSummary;
+    if (st.expectLog)
+    {
+        expectSummary = st.expectLog->summary();
+        st.expectLog.reset();
+    }
+    auto& errorMsg = st.errorMsg;
+    errorMsg = kColorFail;
+    errorMsg.append("fail").append(kColorNormal)
+            .append(kColorTag).append(" '").append(name.c_str()).append(kColorNormal)
+            .append("' (").append(std::to_string(st.execTime)).append(" ms");
+    if (isAsync())
+        errorMsg.append(", seed ").append(std::to_string(seed));
+    errorMsg.append(")\n* * * ").append(msg);
+    if (!expectSummary.empty())
+        errorMsg.append("\n* * * Non-fatal checks also failed: ").append(expectSummary);
+    TEST_LOG("%s", errorMsg.c_str());
+    if (loop)
+        loop->abort();
+}
+
+ASYNCTEST_INLINE void Test::expectFailed(const char* where, std::string&& details)
+{
+    if (auto capture = errorCapture()) //i.e. in a property check - fail the case
+    {
+        if (capture->empty())
+            capture->append(where).append(details.empty() ? "" : "\n* * *   ").append(details);
+        return;
+    }
+    auto& log = state().expectLog;
+    if (!log)
+        log.reset(new ExpectLog);
+    log->add(where, std::move(details));
+}
+
+ASYNCTEST_INLINE void Test::flushExpectations()
+{
+    if (!mState || !mState->expectLog)
+        return;
+    auto summary = mState->expectLog->summary();
+    mState->expectLog.reset();
+    error("Non-fatal checks failed: " + summary);
+}
+
+ASYNCTEST_INLINE void Test::onTimeout(void* arg)
+{
+    //The test thread can't get past the watchdog guard until this returns, but it may still
+    //be running, so only what is needed is read from the test, and it's not modified
+    auto& test = *static_cast<Test*>(arg);
+    const std::string name = test.name.c_str();
+    const std::string fullName = test.fullName();
+    const int timeout = test.syncTimeout();
+    TEST_LOG("%sTIMEOUT%s '%s%s%s' did not complete within %d ms. Backtraces of the other threads:",
+        kColorFail, kColorNormal, kColorTag, name.c_str(), kColorNormal, timeout);
+    Watchdog::dumpBacktraces(1);
+    if (TestGroup::isWorkerProcess()) //the parent reports the failure and continues
+    {
+        fflush(stdout);
+        _exit(WorkerPool::kTimeoutExitCode);
+    }
+    //The test can't be interrupted, so terminate the run, but save the results so far
+    gNumFailed++;
+    TEST_LOG("%sfail%s%s '%s%s' (%d ms)\n* * * Timeout: did not complete within %d ms, terminating the test run",
+        kColorFail, kColorNormal, kColorTag, name.c_str(), kColorNormal, timeout, timeout);
+    gTotalExecTime += timeout;
+    gScheduler.record(fullName, timeout);
+    gPerfBaseline.save();
+    gScheduler.save();
+    gTracer.save();
+    gTimeReport.print();
+    printTotals();
+    fflush(stdout);
+    _exit(WorkerPool::kTimeoutExitCode);
+}
+
+ASYNCTEST_INLINE void Test::writeCrashSummary(int fd)
+{
+    if (TestGroup::isWorkerProcess()) //the parent reports the crash as a failure of the test
+        return;
+    CrashHandler::writeStr(fd, kLine);
+    CrashHandler::writeStr(fd, "\nTest run crashed: ");
+    CrashHandler::writeNum(fd, gNumFailed + 1);
+    CrashHandler::writeStr(fd, " failed (including the crashed one) of ");
+    CrashHandler::writeNum(fd, CrashHandler::numStarted());
+    CrashHandler::writeStr(fd, " tests run, in ");
+    CrashHandler::writeNum(fd, gNumTestGroups);
+    CrashHandler::writeStr(fd, (gNumTestGroups == 1) ? " group\n" : " groups\n");
+    CrashHandler::writeStr(fd, kLine);
+    CrashHandler::writeStr(fd, "\n");
+}
+
+ASYNCTEST_INLINE void Test::printTotals()
+{
+    TEST_LOG("%s", kLine);
+    if (!gNumFailed)
+        TEST_LOG("All %d tests in %d groups %spassed%s (%lld ms)",
+            gNumTests-gNumDisabled-gNumSkipped, gNumTestGroups, kColorSuccess, kColorNormal, gTotalExecTime);
+    else
+        TEST_LOG("Some tests failed: %d %sfailed%s / %d total in %d group%s (%lld ms)",
+            gNumFailed, kColorFail, kColorNormal, gNumTests-gNumDisabled-gNumSkipped,
+            gNumTestGroups, (gNumTestGroups==1)?"":"s", gTotalExecTime);
+    if (gNumDisabled)
+        TEST_LOG("(%d tests DISABLED)", gNumDisabled);
+    if (gNumSkipped)
+        TEST_LOG("(%d tests not selected)", gNumSkipped);
+    gPerfBaseline.printSummary();
+    TEST_LOG("%s", kLine);
+}
+
+ASYNCTEST_INLINE void Test::initColors()
+{
+    if (!isatty(1))
+        return;
+    kColorSuccess = "\033[1;32m";
+    kColorFail = "\033[1;31m";
+    kColorNormal = "\033[0m";
+    kColorTag = "\033[34m";
+    kColorWarning = "\033[33m";
+}
+
+ASYNCTEST_INLINE void Test::doCleanup()
+{
+    auto& cleanup = state().cleanup;
+    if (!cleanup)
+        return;
+    try
+    {
+        cleanup();
+    }
+    catch (BailoutException& e)
+    {  error(std::string("Error during cleanup: ") + e.what());  }
+    catch(std::exception& e)
+    {  error(std::string("Exception during cleanup: ") + e.what());  }
+    catch(...)
+    {  error("Non-standard exception during cleanup");  }
+}
+
+ASYNCTEST_INLINE void Test::execute()
 {
     TEST_LOG("run  '%s%s%s'...", kColorTag, name.c_str(), kColorNormal);
-    const char* execState = "'before-each'";
+    CrashHandler::enterTest(name.c_str());
+    mState.reset(new TestRunState);
+    auto& st = *mState;
+    srand(seed);
+    bool lazyLoop = !loop && body && body->isAsync();
+    const char* execState = "event loop creation";
     Ts start = 0;
+    double cpuStart = 0;
+    PerfCounters::Values countersStart;
+    TraceScope testScope("test", "test ", name.c_str());
     try
     {
+        if (lazyLoop)
+            loop.reset(body->createLoop());
+        if (loop)
+        {
+            loop->setSeed(seed);
+            if (mCompleteGraceMs >= 0)
+            {
+                loop->completeOnDones = true;
+                loop->completeGraceMs = mCompleteGraceMs;
+            }
+        }
+        execState = "'before-each'";
         if (group.beforeEach)
+        {
+            TraceScope traceScope("test", "beforeEach");
+            auto setupStart = getTimeMs();
             group.beforeEach(*this);
+            st.setupTime = getTimeMs() - setupStart;
+        }
 
         start = getTimeMs();
+        cpuStart = getCpuTimeMs();
+        if (measuresCounters() && countersAvailable())
+            countersStart = PerfCounters::forThread().read();
+        TraceScope bodyScope("test", "body");
         if (loop)
         {
             execState = nullptr; //dont log error location
-            loop->schedCall([this]()
+            auto callBody = [this]()
             {
                 body->call();
-            });
+            };
+            //the location of the framework is of no interest
+            if (mStartDelayMs < 0)
+                loop->schedCall(callBody, 100, -1, SrcLoc());
+            else
+                loop->schedCall(callBody, mStartDelayMs, 0, SrcLoc());
             loop->run();
-            execTime = getTimeMs() - start;
+            st.execTime = getTimeMs() - start;
             if (!loop->errorMsg.empty())
                 error(loop->errorMsg);
         }
         else
         {
             execState = nullptr;
+            Watchdog::Guard watchdog(syncTimeout(), &Test::onTimeout, this);
             body->call();
-            execTime = getTimeMs() - start;
+            st.execTime = getTimeMs() - start;
         }
     }
     catch(BailoutException& e)
     {
-        execTime = getTimeMs() - start;
+        st.execTime = getTimeMs() - start;
         if (execState)
             error(std::string("Error during ")+execState+": "+e.what());
         else
@@ -353,7 +1220,7 @@ void Test::run()
     }
     catch(std::exception& e)
     {
-        execTime = getTimeMs() - start;
+        st.execTime = getTimeMs() - start;
         if (execState)
             error(std::string("Exception during ")+execState+": "+e.what());
         else
@@ -361,28 +1228,530 @@ void Test::run()
     }
     catch(...)
     {
-        execTime = getTimeMs() - start;
+        st.execTime = getTimeMs() - start;
         error(std::string("Non-standard exception during ")+execState);
     }
-    gTotalExecTime += execTime;
-    doCleanup();
+    if (loop && !st.errorMsg.empty())
+    {
+        auto events = loop->formatEvents();
+        if (!events.empty())
+            TEST_LOG("%s", events.c_str());
+    }
+    if (start)
+    {
+        st.cpuTime = getCpuTimeMs() - cpuStart;
+        if (loop)
+            st.waitTime = loop->waitTimeMs();
+        else if (st.execTime > st.cpuTime)
+            st.waitTime = st.execTime - (Ts)st.cpuTime;
+    }
+    if (countersStart.valid())
+    {
+        st.counters.add(PerfCounters::forThread().read() - countersStart);
+        if (st.errorMsg.empty())
+            checkCounters();
+    }
+    auto teardownStart = getTimeMs();
+    if (st.cleanup)
+    {
+        TraceScope traceScope("test", "cleanup");
+        doCleanup();
+    }
     if (group.afterEach)
     {
+        TraceScope traceScope("test", "afterEach");
         try { group.afterEach(*this); } catch(...){}
     }
-    if(errorMsg.empty())
+    st.teardownTime = getTimeMs() - teardownStart;
+    flushExpectations();
+    if (lazyLoop)
+        loop.reset();
+    CrashHandler::leaveTest();
+}
+ASYNCTEST_INLINE void Test::finish()
+{
+    auto& st = state();
+    gTotalExecTime += st.execTime;
+    gScheduler.record(fullName(), st.execTime);
+    if (gTimeReport.isEnabled())
+    {
+        TimeReport::TestTimes times;
+        times.name = fullName();
+        times.setup = st.setupTime;
+        times.body = st.execTime;
+        times.idle = std::min(st.waitTime, st.execTime);
+        times.teardown = st.teardownTime;
+        gTimeReport.addTest(std::move(times));
+    }
+    if (st.errorMsg.empty())
+        checkPerformance();
+    if(st.errorMsg.empty())
     {
         TEST_LOG("%spass%s '%s%s%s' (%lld ms)", kColorSuccess, kColorNormal,
-                 kColorTag, name.c_str(), kColorNormal, execTime);
+                 kColorTag, name.c_str(), kColorNormal, st.execTime);
+    }
+    if (st.counters.valid() && gOptions.perfCounters)
+        TEST_LOG("  counters: %s", st.counters.format().c_str());
+}
+ASYNCTEST_INLINE void Test::checkCounters()
+{
+    auto& st = state();
+    if (!st.counters.valid() || !mCounterLimits)
+        return;
+    std::string msg;
+    char buf[256];
+    for (auto& limit: *mCounterLimits)
+    {
+        if (limit.first < 0)
+        {
+            double ipc = st.counters.ipc();
+            if (!ipc || ipc >= limit.second)
+                continue;
+            snprintf(buf, sizeof(buf), "IPC %.2f is below the limit of %.2f", ipc, limit.second);
+        }
+        else
+        {
+            if (!st.counters.has(limit.first) || st.counters[limit.first] <= limit.second)
+                continue;
+            snprintf(buf, sizeof(buf), "Counter %s = %.0f exceeds the limit of %.0f",
+                PerfCounters::name(limit.first), st.counters[limit.first], limit.second);
+        }
+        if (!msg.empty())
+            msg.append("\n* * * ");
+        msg.append(buf);
+    }
+    if (!msg.empty())
+        error(msg);
+}
+ASYNCTEST_INLINE std::string Test::fullName() const
+{
+    return group.name + "/" + name;
+}
+ASYNCTEST_INLINE void Test::checkPerformance()
+{
+    if (!gPerfBaseline.isComparing() && !gPerfBaseline.isRecording())
+        return;
+    auto& st = state();
+    st.metrics.emplace_back("time_ms", st.execTime);
+    st.metrics.emplace_back("cpu_ms", st.cpuTime);
+    for (int i = 0; i < PerfCounters::kNumCounters; i++)
+    {
+        if (st.counters.has(i))
+            st.metrics.emplace_back(PerfCounters::name(i), st.counters[i]);
+    }
+    auto key = fullName();
+    std::string msg;
+    for (auto& m: st.metrics)
+    {
+        auto err = gPerfBaseline.compare(key, m.first, m.second);
+        if (err.empty())
+            continue;
+        if (!msg.empty())
+            msg.append("\n* * * ");
+        msg.append(err);
+    }
+    if (!msg.empty())
+    {
+        error(msg);
+        return;
+    }
+    for (auto& m: st.metrics) //a regressed run is not folded into the new baseline
+        gPerfBaseline.record(key, m.first, m.second);
+}
+ASYNCTEST_INLINE std::string Test::serializeResult()
+{
+    auto& st = state();
+    RecordWriter rec;
+    rec.add("time", st.execTime).add("cpu", st.cpuTime);
+    rec.add("setup", st.setupTime).add("teardown", st.teardownTime).add("wait", st.waitTime);
+    if (!st.errorMsg.empty())
+        rec.add("err", st.errorMsg);
+    for (auto& m: st.metrics)
+        rec.add("metric", m.first).add("value", m.second);
+    if (st.counters.valid())
+        rec.add("counters", st.counters.toString());
+    return rec.data;
+}
+ASYNCTEST_INLINE void Test::applyResult(WorkerPool::Completion& completion)
+{
+    mState.reset(new TestRunState);
+    auto& st = *mState;
+    auto abnormalExit = completion.abnormalExitReason();
+    if (!abnormalExit.empty())
+    {
+        if (WIFEXITED(completion.status) && WEXITSTATUS(completion.status) == WorkerPool::kTimeoutExitCode)
+            st.execTime = syncTimeout();
+        error(abnormalExit);
+        return;
+    }
+    RecordReader reader(completion.result);
+    std::string field, val;
+    while (reader.next(field, val))
+    {
+        if (field == "time")
+            st.execTime = atoll(val.c_str());
+        else if (field == "cpu")
+            st.cpuTime = atof(val.c_str());
+        else if (field == "setup")
+            st.setupTime = atoll(val.c_str());
+        else if (field == "teardown")
+            st.teardownTime = atoll(val.c_str());
+        else if (field == "wait")
+            st.waitTime = atoll(val.c_str());
+        else if (field == "err")
+        {
+            st.errorMsg = val; //already logged by the worker
+            gNumFailed++;
+        }
+        else if (field == "metric")
+            st.metrics.emplace_back(val, 0);
+        else if (field == "value" && !st.metrics.empty())
+            st.metrics.back().second = atof(val.c_str());
+        else if (field == "counters")
+            st.counters = PerfCounters::Values::fromString(val);
+        else if (field == "trace")
+            gTracer.import(val);
     }
 }
-inline Test& Test::disable()
+ASYNCTEST_INLINE Test& Test::disable()
 {
     isDisabled = true;
     gNumDisabled++;
     group.numDisabled++;
     return *this;
 }
+ASYNCTEST_INLINE ParamTest& ParamTest::disable()
+{
+    isDisabled = true;
+    gNumDisabled += numCases;
+    mGroup.numDisabled += numCases;
+    return *this;
+}
+ASYNCTEST_INLINE Test& Test::completeOnDones(int graceMs)
+{
+    if (!isAsync())
+        throw std::runtime_error("completeOnDones() can be used only with async tests");
+    mCompleteGraceMs = graceMs; //applied to the loop when the test is executed
+    return *this;
+}
+ASYNCTEST_INLINE void TestGroup::run()
+{
+    if (gOptions.crashHandler)
+        CrashHandler::install(&Test::writeCrashSummary);
+    CrashHandler::enterGroup(name.c_str());
+    TEST_LOG("%s", Test::kLine);
+    TraceScope groupScope("group", "group ", name);
+    std::vector<PlannedTest> planned;
+    TimeReport::GroupTimes times;
+    auto groupStart = Test::getTimeMs();
+	try
+	{
+        {
+            TraceScope traceScope("group", "setup");
+            body(*this);
+        }
+        planned = planTests();
+        times.setup = Test::getTimeMs() - groupStart;
+        numTests = planned.size();
+        for (auto& test: tests) //warn in the main process, rather than in each worker
+        {
+            if (gOptions.perfCounters || test->measuresCounters())
+            {
+                Test::countersAvailable();
+                break;
+            }
+        }
+        unsigned numSkipped = numTotalTests() - numDisabled - numTests;
+        gNumSkipped += numSkipped;
+        TEST_LOG_NO_EOL("RUN   Group '%s%s%s' (%u test%s", kColorTag,
+            name.c_str(), kColorNormal, numTests, (numTests == 1) ? "" : "s");
+        if (numDisabled)
+        {
+            TEST_LOG_NO_EOL(", %d disabled", numDisabled);
+        }
+        if (numSkipped)
+        {
+            TEST_LOG_NO_EOL(", %u not selected", numSkipped);
+        }
+        TEST_LOG(")...\n%s", Test::kThinLine);
+	}
+    catch(BailoutException& e)
+    {
+        error(std::string("Error at test group setup: ")+e.what());
+        return;
+    }
+	catch(std::exception& e)
+	{
+        error(std::string("Exception during test group setup:")+e.what());
+		return;
+	}
+	catch(...)
+	{
+        error("Non-standard exception during test group setup");
+		return;
+	}
+    for (auto& test: tests)
+	{
+        if (test->isDisabled)
+        {
+            TEST_LOG("%sdis%s  '%s%s%s'\n%s", kColorWarning, kColorNormal,
+                kColorTag, test->name.c_str(), kColorNormal, Test::kThinLine);
+        }
+    }
+    for (auto& param: paramTests)
+    {
+        if (param->isDisabled)
+        {
+            TEST_LOG("%sdis%s  '%s%s/*%s' (%zu cases)\n%s", kColorWarning, kColorNormal,
+                kColorTag, param->name.c_str(), kColorNormal, param->numCases, Test::kThinLine);
+        }
+    }
+    if (gOptions.isRepeating())
+    {
+        for (auto& item: planned)
+            runRepeated(*item.get());
+    }
+    else if (gOptions.numJobs() > 1)
+    {
+        runParallel(planned);
+    }
+    else
+    {
+        for (auto& item: planned)
+        {
+            auto test = item.get();
+            test->run();
+            onTestComplete(*test);
+        }
+    }
+
+    auto cleanupStart = Test::getTimeMs();
+	if (allCleanup)
+    {
+        try
+        {
+            allCleanup();
+        }
+        catch(BailoutException& e)
+        { error(e.what()); }
+        catch(std::exception& e)
+        {  error(std::string("Exception in cleanup of test group: ")+e.what());  }
+        catch(...)
+        {  error("Non standard exception in cleanup of test group");  }
+    }
+    if (gTimeReport.isEnabled() && !gOptions.isRepeating())
+    {
+        auto now = Test::getTimeMs();
+        times.name = name;
+        times.cleanup = now - cleanupStart;
+        times.wall = now - groupStart;
+        gTimeReport.addGroup(std::move(times));
+    }
+    printSummary();
+}
+
+ASYNCTEST_INLINE std::vector<PlannedTest> TestGroup::planTests()
+{
+    std::vector<PlannedTest> enabled;
+    const bool filtered = !gOptions.filter.empty();
+    //the plain and the parameterized tests, in the order in which they were added
+    auto addParamCases = [&](ParamTest& param)
+    {
+        if (param.isDisabled)
+            return;
+        for (size_t i = 0; i < param.numCases; i++)
+        {
+            if (filtered && !gOptions.isSelected(name + "/" + param.caseName(i)))
+                continue;
+            enabled.emplace_back();
+            enabled.back().paramTest = &param;
+            enabled.back().index = i;
+        }
+    };
+    size_t nextParam = 0;
+    for (size_t pos = 0; pos <= tests.size(); pos++)
+    {
+        for (; nextParam < paramTests.size() && paramTests[nextParam]->position == pos; nextParam++)
+            addParamCases(*paramTests[nextParam]);
+        if (pos == tests.size())
+            break;
+        auto& test = tests[pos];
+        if (test->isDisabled)
+            continue;
+        if (filtered && !gOptions.isSelected(test->fullName()))
+            continue;
+        enabled.emplace_back();
+        enabled.back().test = test;
+    }
+    const bool lptOrder = gOptions.numJobs() > 1;
+    if (!gScheduler.reorders(lptOrder))
+        return enabled;
+    std::vector<PlannedTest> planned;
+    auto keyOf = [this, &enabled](size_t idx)
+    {
+        auto& item = enabled[idx];
+        return item.paramTest ? (name + "/" + item.paramTest->caseName(item.index)) : item.test->fullName();
+    };
+    for (auto idx: gScheduler.plan(enabled.size(), keyOf, lptOrder))
+        planned.push_back(enabled[idx]);
+    return planned;
+}
+
+ASYNCTEST_INLINE void TestGroup::runParallel(const std::vector<PlannedTest>& planned)
+{
+    Ts start = Test::getTimeMs();
+    WorkerPool pool(gOptions.numJobs());
+    for (auto& item: planned)
+    {
+        auto test = item.get(); //kept alive by the completion handler
+        test->initSeed();
+        pool.spawn([test]()
+        {
+            return executeInWorker(*test);
+        },
+        [this, test](WorkerPool::Completion& completion)
+        {
+            fwrite(completion.output.data(), 1, completion.output.size(), stdout);
+            test->applyResult(completion);
+            test->finish();
+            onTestComplete(*test);
+        });
+    }
+    pool.waitAll();
+    wallTime = Test::getTimeMs() - start;
+}
+
+ASYNCTEST_INLINE void TestGroup::runRepeated(Test& test)
+{
+    enum { kMaxSeedsShown = 10 };
+    unsigned maxRuns = gOptions.repeat ? gOptions.repeat : UINT_MAX;
+    unsigned baseSeed = (gOptions.seed >= 0) ? (unsigned)gOptions.seed : (unsigned)rand();
+    TEST_LOG("run  '%s%s%s' x %s...", kColorTag, test.name.c_str(), kColorNormal,
+        gOptions.repeat ? std::to_string(maxRuns).c_str() : "until-fail");
+    unsigned numRuns = 0;
+    std::vector<unsigned> failedSeeds;
+    std::string firstFailure;
+    Ts totalTime = 0;
+    {
+        WorkerPool pool(gOptions.numJobs());
+        for (unsigned i = 0; i < maxRuns; i++)
+        {
+            if (gOptions.untilFail && !failedSeeds.empty())
+                break;
+            unsigned seed = baseSeed + i;
+            pool.spawn([&test, seed]()
+            {
+                test.seed = seed;
+                return executeInWorker(test);
+            },
+            [&, seed](WorkerPool::Completion& completion)
+            {
+                numRuns++;
+                if (gTracer.isEnabled())
+                    gTracer.import(RecordReader::get(completion.result, "trace"));
+                totalTime += atoll(RecordReader::get(completion.result, "time").c_str());
+                auto err = completion.abnormalExitReason();
+                if (err.empty() && RecordReader::get(completion.result, "err").empty())
+                    return;
+                if (failedSeeds.empty())
+                    firstFailure = completion.output + err;
+                failedSeeds.push_back(seed);
+            });
+        }
+        pool.waitAll();
+    }
+    test.seed = failedSeeds.empty() ? baseSeed : failedSeeds[0];
+    auto& st = test.state();
+    st.execTime = numRuns ? totalTime / numRuns : 0;
+    gTotalExecTime += totalTime;
+    if (failedSeeds.empty())
+    {
+        TEST_LOG("%spass%s '%s%s%s' (%u runs, avg %lld ms)", kColorSuccess, kColorNormal,
+            kColorTag, test.name.c_str(), kColorNormal, numRuns, st.execTime);
+    }
+    else
+    {
+        TEST_LOG("First failed run (seed %u):\n%s", failedSeeds[0], firstFailure.c_str());
+        std::string seeds;
+        for (size_t i = 0; i < failedSeeds.size() && i < kMaxSeedsShown; i++)
+            seeds.append(i ? ", " : "").append(std::to_string(failedSeeds[i]));
+        if (failedSeeds.size() > kMaxSeedsShown)
+            seeds.append(", ...");
+        char buf[128];
+        snprintf(buf, sizeof(buf), "%zu of %u runs failed (%.2f%%)", failedSeeds.size(),
+            numRuns, failedSeeds.size() * 100.0 / numRuns);
+        test.error(std::string(buf) + "\n* * * Failing seeds: " + seeds
+            + "\n* * * Reproduce with: --filter='" + test.fullName()
+            + "' --seed=" + std::to_string(failedSeeds[0]));
+    }
+    onTestComplete(test);
+}
+
+ASYNCTEST_INLINE std::string TestGroup::executeInWorker(Test& test)
+{
+    isWorkerProcess() = true;
+    auto traceMark = gTracer.size();
+    if (gTracer.isEnabled())
+        gTracer.setProcessName("worker: " + test.fullName());
+    test.execute();
+    auto result = test.serializeResult();
+    if (gTracer.isEnabled())
+    {
+        RecordWriter rec;
+        rec.add("trace", gTracer.serialize(traceMark));
+        result.append(rec.data);
+    }
+    return result;
+}
+
+ASYNCTEST_INLINE void TestGroup::onTestComplete(Test& test)
+{
+    TEST_LOG("%s", Test::kThinLine);
+    auto& st = test.state();
+    execTime += st.execTime;
+    if (!st.errorMsg.empty())
+    {
+        error(st.errorMsg);
+    }
+    test.releaseState();
+}
+
+ASYNCTEST_INLINE void TestGroup::error(const std::string& msg)
+{
+    numErrors++;
+    if (hasError())
+        return;
+    errorMsg = msg;
+}
+
+ASYNCTEST_INLINE void TestGroup::printSummary()
+{
+    std::string wall;
+    if (wallTime)
+        wall = ", " + std::to_string(wallTime) + " ms wall";
+    if (!numErrors)
+    {
+        TEST_LOG("%sPASS%s  Group '%s%s%s': 0 errors / %u test%s (%lld ms%s)",
+            kColorSuccess, kColorNormal, kColorTag, name.c_str(), kColorNormal,
+            numTests, (numTests==1)?"":"s", execTime, wall.c_str());
+    }
+    else
+    {
+        TEST_LOG("%sFAIL%s  Group '%s%s%s': %u error%s / %u test%s (%lld ms%s)",
+            kColorFail, kColorNormal, kColorTag, name.c_str(), kColorNormal,
+            numErrors, (numErrors==1)?"":"s", numTests,
+            (numTests==1)?"":"s", execTime, wall.c_str());
+    }
+}
+ASYNCTEST_INLINE int runRegisteredGroups()
+{
+    for (auto& entry: GroupRegistry::groups())
+    {
+        TestGroup group(entry.name, entry.body); //runs the group
+    }
+    return gNumFailed;
+}
+#endif
 
 } //end namespace
 
@@ -394,11 +1763,32 @@ inline Test& Test::disable()
 #define TestGroup(name)\
     TEST_TOKENPASTE(test::TestGroup group, __LINE__) (name, [&](test::TestGroup& group)
 
+/** Defines a test group at namespace scope, in any translation unit. The group is run by
+ * test::runRegisteredGroups(), instead of immediately */
+#define registerTestGroup(name)\
+    static test::GroupRegistrar TEST_TOKENPASTE(_testGroupRegistrar, __LINE__) (name, [](test::TestGroup& group)
+
 #define syncTest(name)\
     group.addTest(name, nullptr, [&](test::Test& test)
 
+#define stressTest(name, threads, iterations)\
+    group.addStressTest(name, threads, iterations, [&](test::StressThread& test, size_t iteration)
+
 #define asyncTest(name,...)\
-    group.addTest(name, new test::EventLoop(__VA_ARGS__), [&](test::Test& test, test::EventLoop& loop)
+    group.addAsyncTest(name, [=]() { return new test::EventLoop(__VA_ARGS__); }, \
+        [&](test::Test& test, test::EventLoop& loop)
+
+#define paramTest(name, params)\
+    group.addParamTest(name, params, [&](test::Test& test, \
+        const test::RangeParamOf<decltype(params)>::type& param)
+
+#define asyncParamTest(name, params)\
+    group.addParamTest(name, params, [&](test::Test& test, test::EventLoop& loop, \
+        const test::RangeParamOf<decltype(params)>::type& param)
+
+#define paramTestGen(name, count, gen)\
+    group.addParamTest(name, count, gen, [&](test::Test& test, \
+        const test::GenParamOf<decltype(gen)>::type& param)
 
 
 //check convenience macros
@@ -412,6 +1802,61 @@ do {                                 \
   throw test::BailoutException(msg); \
 } while(0)
 
+/** Comparison checks. On failure, they report the values of both operands, in addition
+ * to the expressions. Each operand is evaluated exactly once */
+#define TEST_CHECK_OP(checkName, a, b, op) \
+do {                                                    \
+  const auto& _checkA = (a);                            \
+  const auto& _checkB = (b);                            \
+  if (ASYNCTEST_LIKELY(_checkA op _checkB)) break;      \
+  test::detail::checkOpFailed(test, checkName, #a, #b, _checkA, _checkB, \
+      __FILE__ ":" TEST_STRLITERAL(__LINE__));          \
+} while(0)
+
+#define checkEq(a, b) TEST_CHECK_OP("checkEq", a, b, ==)
+#define checkNe(a, b) TEST_CHECK_OP("checkNe", a, b, !=)
+#define checkLt(a, b) TEST_CHECK_OP("checkLt", a, b, <)
+#define checkLe(a, b) TEST_CHECK_OP("checkLe", a, b, <=)
+#define checkGt(a, b) TEST_CHECK_OP("checkGt", a, b, >)
+#define checkGe(a, b) TEST_CHECK_OP("checkGe", a, b, >=)
+
+/** Checks that \c a and \c b differ by at most \c eps. Fails if either is NaN */
+#define checkNear(a, b, eps) \
+do {                                                    \
+  const auto& _checkA = (a);                            \
+  const auto& _checkB = (b);                            \
+  const auto& _checkEps = (eps);                        \
+  if (ASYNCTEST_LIKELY(std::fabs(_checkA - _checkB) <= _checkEps)) break; \
+  test::detail::checkNearFailed(test, #a, #b, #eps, _checkA, _checkB, _checkEps, \
+      __FILE__ ":" TEST_STRLITERAL(__LINE__));          \
+} while(0)
+
+/** Non-fatal checks. A failure is recorded and the test continues, and when it completes, it
+ * fails with a summary of all failures, grouped by check. The values of the operands of the
+ * first failures are shown, up to --expect-limit per test */
+#define expect(cond) \
+do {                                                    \
+  if (ASYNCTEST_LIKELY(cond)) break;                    \
+  test.expectFailed("expect(" #cond ") failed at " __FILE__ ":" TEST_STRLITERAL(__LINE__), \
+      std::string());                                   \
+} while(0)
+
+#define TEST_EXPECT_OP(checkName, a, b, op) \
+do {                                                    \
+  const auto& _checkA = (a);                            \
+  const auto& _checkB = (b);                            \
+  if (ASYNCTEST_LIKELY(_checkA op _checkB)) break;      \
+  test::detail::expectOpFailed(test, checkName "(" #a ", " #b ") failed at " \
+      __FILE__ ":" TEST_STRLITERAL(__LINE__), #a, #b, _checkA, _checkB); \
+} while(0)
+
+#define expectEq(a, b) TEST_EXPECT_OP("expectEq", a, b, ==)
+#define expectNe(a, b) TEST_EXPECT_OP("expectNe", a, b, !=)
+#define expectLt(a, b) TEST_EXPECT_OP("expectLt", a, b, <)
+#define expectLe(a, b) TEST_EXPECT_OP("expectLe", a, b, <=)
+#define expectGt(a, b) TEST_EXPECT_OP("expectGt", a, b, >)
+#define expectGe(a, b) TEST_EXPECT_OP("expectGe", a, b, >=)
+
 #define doneOrError(cond, name) do { check((cond)); loop.done(name); } while(0)
 
 #endif // ASYNCTEST_H
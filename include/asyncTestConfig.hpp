@@ -0,0 +1,32 @@
+/** @file Compilation mode of the async unit testing framework
+ *  By default, the framework is header-only. If ASYNCTEST_SEPARATE_COMPILATION is defined
+ *  (in all translation units, i.e. via -DASYNCTEST_SEPARATE_COMPILATION), the headers contain
+ *  only declarations of the non-template parts of the runtime - the test runner, reporting,
+ *  the event loop, etc. These are compiled once, into libasynctest.a (see the Makefile in the
+ *  root directory of the repository), which must be linked with the test executable.
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_CONFIG_H
+#define ASYNCTEST_CONFIG_H
+
+#ifdef ASYNCTEST_SEPARATE_COMPILATION
+    #define ASYNCTEST_INLINE
+    #ifdef ASYNCTEST_IMPLEMENTATION //defined only when compiling the library
+        #define ASYNCTEST_COMPILE_IMPL
+    #endif
+#else
+    #define ASYNCTEST_INLINE inline
+    #define ASYNCTEST_COMPILE_IMPL
+#endif
+
+//Code placement hints for the failure paths of the checks
+#if defined(__GNUC__) || defined(__clang__)
+    #define ASYNCTEST_LIKELY(cond) __builtin_expect(!!(cond), 1)
+    #define ASYNCTEST_COLD __attribute__((noinline, cold))
+#else
+    #define ASYNCTEST_LIKELY(cond) (cond)
+    #define ASYNCTEST_COLD
+#endif
+
+#endif
@@ -0,0 +1,228 @@
+/** @file Reporting of crashes (SIGSEGV, SIGABRT, etc) of the test process, attributed to the
+ *  test that was running
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_CRASHHANDLER_H
+#define ASYNCTEST_CRASHHANDLER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#ifdef __linux__
+    #include <execinfo.h>
+#endif
+#include "asyncTestConfig.hpp"
+
+namespace test
+{
+/** Signal handlers that report a crash - the signal, the group and the test that was running,
+ * and a backtrace - and then let the signal take its course, via the handler that was
+ * installed before, or the default action. Only async-signal-safe functions are used in the
+ * handler: the output is written with write(), and the output that is buffered in stdout is
+ * written directly from the stdio buffer, without locking it (with glibc - otherwise stdout is
+ * made line-buffered at install(), so that there is no buffered output to lose).
+ * The handlers run on an alternate stack, so that a stack overflow can also be reported. An
+ * alternate stack is per thread - install() sets up the one of the calling thread, and other
+ * threads need a ThreadAltStack, as the threads of stress tests have. A stack overflow in any
+ * other thread kills the process without a report
+ */
+class CrashHandler
+{
+public:
+/** Writes additional information, i.e. a summary of the test run, from the signal handler */
+    typedef void (*ReportFunc)(int fd);
+    enum { kNumSignals = 5 };
+    enum { kAltStackSize = 64 * 1024 };
+protected:
+    struct State
+    {
+        const char* volatile group = nullptr;
+        const char* volatile test = nullptr;
+        volatile unsigned long numStarted = 0;
+        ReportFunc report = nullptr;
+        bool installed = false;
+        struct sigaction prevActions[kNumSignals];
+    };
+    static State& state()
+    {
+        static State sState;
+        return sState;
+    }
+    static const int* signals()
+    {
+        static const int sSignals[kNumSignals] = { SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL };
+        return sSignals;
+    }
+    static const char* signalName(int sig)
+    {
+        switch (sig)
+        {
+            case SIGSEGV: return "SIGSEGV, segmentation fault";
+            case SIGABRT: return "SIGABRT, abort";
+            case SIGBUS: return "SIGBUS, bus error";
+            case SIGFPE: return "SIGFPE, arithmetic exception";
+            case SIGILL: return "SIGILL, illegal instruction";
+            default: return "unknown signal";
+        }
+    }
+/** Writes the output buffered in stdout, without locking it */
+    static void flushStdout()
+    {
+#ifdef __GLIBC__
+        char* start = stdout->_IO_write_base;
+        char* end = stdout->_IO_write_ptr;
+        if (start && end > start)
+        {
+            if (write(1, start, end - start) < 0) {} //nothing to do about it
+            stdout->_IO_write_ptr = start;
+        }
+#endif
+    }
+    static void onSignal(int sig);
+public:
+/** Async-signal-safe output helpers, for the report functions */
+    static void writeStr(int fd, const char* str)
+    {
+        if (str && write(fd, str, strlen(str)) < 0) {}
+    }
+    static void writeNum(int fd, unsigned long num)
+    {
+        char buf[24];
+        char* pos = buf + sizeof(buf);
+        do
+        {
+            *--pos = '0' + num % 10;
+            num /= 10;
+        } while (num);
+        if (write(fd, pos, buf + sizeof(buf) - pos) < 0) {}
+    }
+/** Installs the handlers. Calling it again has no effect */
+    static void install(ReportFunc report);
+    static bool isInstalled() { return state().installed; }
+    static void enterGroup(const char* name)
+    {
+        state().group = name;
+        state().test = nullptr;
+    }
+    static void enterTest(const char* name)
+    {
+        state().test = name;
+        state().numStarted = state().numStarted + 1;
+    }
+    static void leaveTest() { state().test = nullptr; }
+/** Sets up an alternate signal stack for the calling thread, for the lifetime of the object,
+ * so that a stack overflow in that thread can be reported. Does nothing if the handlers are
+ * not installed */
+    class ThreadAltStack
+    {
+    protected:
+        void* mStack = nullptr;
+    public:
+        ThreadAltStack()
+        {
+            if (!isInstalled() || !(mStack = malloc(kAltStackSize)))
+                return;
+            stack_t ss;
+            memset(&ss, 0, sizeof(ss));
+            ss.ss_sp = mStack;
+            ss.ss_size = kAltStackSize;
+            if (sigaltstack(&ss, nullptr) != 0)
+            {
+                free(mStack);
+                mStack = nullptr;
+            }
+        }
+        ~ThreadAltStack()
+        {
+            if (!mStack)
+                return;
+            stack_t ss;
+            memset(&ss, 0, sizeof(ss));
+            ss.ss_flags = SS_DISABLE;
+            sigaltstack(&ss, nullptr);
+            free(mStack);
+        }
+        ThreadAltStack(const ThreadAltStack&) = delete;
+        ThreadAltStack& operator=(const ThreadAltStack&) = delete;
+    };
+/** The number of tests that were started in this process, or its parent, if forked */
+    static unsigned long numStarted() { return state().numStarted; }
+};
+
+#ifdef ASYNCTEST_COMPILE_IMPL
+ASYNCTEST_INLINE void CrashHandler::install(ReportFunc report)
+{
+    auto& st = state();
+    st.report = report;
+    if (st.installed)
+        return;
+    st.installed = true;
+#ifndef __GLIBC__
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+#endif
+#ifdef __linux__
+    void* dummy[1];
+    backtrace(dummy, 1); //loads libgcc, which allocates, outside of the signal handler
+#endif
+    static char sAltStack[kAltStackSize];
+    stack_t ss;
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_sp = sAltStack;
+    ss.ss_size = sizeof(sAltStack);
+    sigaltstack(&ss, nullptr);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_ONSTACK;
+    for (int i = 0; i < kNumSignals; i++)
+        sigaction(signals()[i], &action, &st.prevActions[i]);
+}
+
+ASYNCTEST_INLINE void CrashHandler::onSignal(int sig)
+{
+    auto& st = state();
+    flushStdout();
+    const int fd = 1;
+    writeStr(fd, "\n*** CRASH: ");
+    writeStr(fd, signalName(sig));
+    if (st.test)
+    {
+        writeStr(fd, ", in test '");
+        writeStr(fd, st.group);
+        writeStr(fd, "/");
+        writeStr(fd, st.test);
+        writeStr(fd, "'\n");
+    }
+    else if (st.group)
+    {
+        writeStr(fd, ", in group '");
+        writeStr(fd, st.group);
+        writeStr(fd, "', outside of a test\n");
+    }
+    else
+    {
+        writeStr(fd, ", outside of a test group\n");
+    }
+#ifdef __linux__
+    void* frames[64];
+    int num = backtrace(frames, 64);
+    writeStr(fd, "Backtrace:\n");
+    backtrace_symbols_fd(frames, num, fd);
+#endif
+    if (st.report)
+        st.report(fd);
+    //let the signal take its course
+    for (int i = 0; i < kNumSignals; i++)
+    {
+        if (signals()[i] == sig)
+            sigaction(sig, &st.prevActions[i], nullptr);
+    }
+    raise(sig);
+}
+#endif
+}
+#endif
@@ -7,6 +7,9 @@
 
 #include <vector>
 #include <map>
+#include <string>
+#include <memory>
+#include <chrono>
 #include <mutex>
 #include <thread>
 #include <string.h> //for strcmp
@@ -14,6 +17,15 @@
 #include <unistd.h>
 #include <inttypes.h> //for PRIu64
 #include <cstdlib> //for abs
+#include "asyncTestConfig.hpp"
+#include "srcLoc.hpp"
+#include "loopBackend.hpp"
+
+/** The number of most recent events of an event loop that are kept by its flight recorder.
+ * Preferably a power of 2 */
+#ifndef TESTLOOP_FLIGHT_RECORDER_SIZE
+    #define TESTLOOP_FLIGHT_RECORDER_SIZE 64
+#endif
 
 /** default timeout for a done() item */
 #ifndef TESTLOOP_DEFAULT_DONE_TIMEOUT
@@ -40,6 +52,14 @@
 #else
     #define TESTLOOP_LOG_DEBUG(fmtString,...)
 #endif
+
+/** Trace points, for recording a timeline of the loop activity. They are no-ops
+ * unless defined before including this header, as the test framework does */
+#ifndef TESTLOOP_TRACE_SCOPE
+    #define TESTLOOP_TRACE_SCOPE(cat, name)
+    #define TESTLOOP_TRACE_SCOPE_AT(cat, name, loc)
+    #define TESTLOOP_TRACE_INSTANT(cat, name)
+#endif
 namespace test
 {
 template <class M>
@@ -52,6 +72,56 @@ public:
     ~Unlocker() { mLock.lock(); }
 };
 
+/** An always-on record of the most recent events of an event loop - the scheduling and
+ * execution of calls, the resolving of done() items, errors and sleeps - in a fixed-size ring
+ * buffer. Unlike the TESTLOOP_DEBUG logging, recording doesn't change the timing noticeably:
+ * it doesn't allocate or read the clock (the loop provides the timestamp), and costs a few ns.
+ * The framework prints the record only when a test fails
+ */
+class FlightRecorder
+{
+public:
+    typedef long long Ts;
+    enum: char
+    {
+        kSchedule = 's', kCall = 'c', kDoneTimeout = 't', kDone = 'd', kError = 'e', kSleep = 'z'
+    };
+    struct Event
+    {
+        Ts ts;
+        Ts arg; //the due time of a call, or the duration of a sleep
+        const char* tag; //the tag of the done() item, if any
+        const char* file; //where the call was scheduled, or done() was called, if known
+        int line;
+        char type;
+    };
+    enum { kSize = TESTLOOP_FLIGHT_RECORDER_SIZE };
+protected:
+    Event mEvents[kSize];
+    unsigned mCount = 0;
+public:
+    void add(char type, Ts ts, Ts arg, const char* tag, const SrcLoc& loc=SrcLoc())
+    {
+        auto& event = mEvents[mCount++ % kSize];
+        event.ts = ts;
+        event.arg = arg;
+        event.tag = tag;
+        event.file = loc.file;
+        event.line = loc.line;
+        event.type = type;
+    }
+/** The total number of events recorded, including the ones that were overwritten */
+    unsigned count() const { return mCount; }
+/** Formats the recorded events, one per line, with times relative to \c startTs */
+    std::string format(Ts startTs, const char* indent="  ") const;
+/** Appends " <prefix> <file>:<line>" to \c out, if the location is known */
+    static void appendLoc(std::string& out, const char* prefix, const SrcLoc& loc)
+    {
+        if (loc.isKnown())
+            out.append(" ").append(prefix).append(" ").append(loc.toString());
+    }
+};
+
 /** An async execution loop that runs scheduled function calls, added via schedCall(),
  * and watches for user-specified 'conditions', added via addDone() being resolved
  * within the specified timeout
@@ -84,6 +154,14 @@ protected:
 */
     struct SchedItemBase
     {
+        Ts ts = 0; //the time at which the item is due, i.e. its key in the sched queue
+        Ts nominalTs = 0; //periodic calls: the deadline without the jitter
+        int interval = 0; //periodic calls: the period, in ms
+        int jitterPct = 0; //periodic calls: the jitter applied to each deadline
+        bool pending = true; //cleared when cancelled, or when a one-shot call starts executing
+        Ts createdTs = 0; //the time of the loop iteration in which the call was scheduled
+        SrcLoc loc; //where the call was scheduled, if known
+        const char* doneTag = nullptr; //set for the timeout handler of a done() item
         virtual void operator()() = 0;
         virtual ~SchedItemBase(){}
     };
@@ -91,14 +169,48 @@ protected:
     struct SchedItem: public SchedItemBase
     {
         CB mCb;
-        SchedItem(CB&& cb): mCb(std::forward<CB>(cb)){}
+        template <class F>
+        SchedItem(F&& cb): mCb(std::forward<F>(cb)){}
         virtual void operator()() { mCb(); }
     };
 /**The sched queue key has a timestamp as the key.
  * So it's always ordered in execution time order
 */
     typedef std::multimap<Ts, std::shared_ptr<SchedItemBase> > SchedQueue;
-
+public:
+/** A handle to a call scheduled by schedCall() or schedPeriodic(), that can be used to cancel it.
+ * It does not keep the call alive - once the call has been executed (or the loop destroyed),
+ * the handle becomes a no-op */
+    class SchedHandle
+    {
+    protected:
+        EventLoop* mLoop = nullptr;
+        std::weak_ptr<SchedItemBase> mItem;
+    public:
+        SchedHandle() {}
+        SchedHandle(EventLoop& loop, const std::shared_ptr<SchedItemBase>& item)
+        : mLoop(&loop), mItem(item) {}
+/** Returns whether the call is still scheduled to be executed (again, for periodic calls) */
+        bool isPending() const
+        {
+            auto item = mItem.lock();
+            return item && item->pending;
+        }
+/** Cancels the call. A periodic call can be cancelled also from within its own callback, while
+ * a one-shot call is no longer pending once it has started executing.
+ * Cancelling an ordered call does not affect the timing of the following ordered calls.
+ * @returns Whether the call was pending
+ */
+        bool cancel()
+        {
+            auto item = mItem.lock();
+            if (!item || !item->pending)
+                return false;
+            mLoop->cancelItem(item);
+            return true;
+        }
+    };
+protected:
 /**A done() item (added by addDone()) that has to be resolved by the user code
  * withing a specified timeout and/or order, related to other such items
 */
@@ -109,11 +221,14 @@ protected:
         Ts deadline = -1; //means the loop will set its default
         int order = 0;
         SchedQueue::iterator schedItem;
-        DoneItem(const char* aTag): tag(aTag){}
-        DoneItem(const char* aTag, const char* name1, int val1)
-        :tag(aTag) { setVal(name1, val1); }
-        DoneItem(const char* aTag, const char* name1, int val1, const char* name2, int val2)
-        :tag(aTag)
+        SrcLoc loc; //where the item was declared
+        SrcLoc resolvedLoc; //where done() or error() was called for the item
+        DoneItem(const char* aTag, SrcLoc aLoc=ASYNCTEST_CALLER_LOC): tag(aTag), loc(aLoc) {}
+        DoneItem(const char* aTag, const char* name1, int val1, SrcLoc aLoc=ASYNCTEST_CALLER_LOC)
+        :tag(aTag), loc(aLoc) { setVal(name1, val1); }
+        DoneItem(const char* aTag, const char* name1, int val1, const char* name2, int val2,
+            SrcLoc aLoc=ASYNCTEST_CALLER_LOC)
+        :tag(aTag), loc(aLoc)
         {
             setVal(name1, val1);
             setVal(name2, val2);
@@ -121,7 +236,7 @@ protected:
         DoneItem(const DoneItem&) = default;
         DoneItem(DoneItem&& other)
         :tag(std::move(other.tag)), complete(other.complete), deadline(other.deadline),
-          order(other.order){}
+          order(other.order), loc(other.loc), resolvedLoc(other.resolvedLoc) {}
         void setVal(const char* name, int val)
         {
             if ((strcmp(name, "timeout") == 0) || (strcmp(name, "tmo") == 0))
@@ -136,8 +251,26 @@ protected:
     Ts mLastOrderTs = 0;
     int mLastOrderedDoneNo = 0;
     Ts mNextEventTs = 0xFFFFFFFFFFFFFFF;
+    Ts mStartTs = 0;
+/** The time at which the current scheduled call was started, to avoid reading the clock on
+ * each schedCall() */
+    Ts mIterationTs = 0;
+/** The total time that the loop spent waiting for its next event, i.e. not running handlers */
+    Ts mWaitMs = 0;
+/** Always-on record of the most recent loop events, printed when the test fails */
+    FlightRecorder mRecorder;
+/** State of the random generator used for the jitter of the scheduled calls */
+    uint64_t mRandState = 0;
 public:
     int jitterPct = 50;
+/** The seed of the random generator that determines the jitter. Set it via setSeed() */
+    unsigned seed = 0;
+/** If set, the loop completes as soon as all done() items are resolved, without waiting
+ * for the pending scheduled calls, which are cancelled. See also completeGraceMs */
+    bool completeOnDones = false;
+/** In completeOnDones mode, the pending scheduled calls that are due within this
+ * period after the last done() item is resolved are still executed */
+    int completeGraceMs = 0;
 protected:
 #ifndef TEST_HAVE_COLOR_VARS
     const char* kColorSuccess = "";
@@ -152,11 +285,25 @@ protected:
     DoneMap mDones;
     int defaultDoneTimeout;
     bool mHasDefaultDone = false;
+    size_t mNumDonesPending = 0;
+/** The number of periodic calls in the sched queue. These don't keep the loop running
+ * once all done() items are resolved */
+    size_t mNumPeriodic = 0;
+/** In completeOnDones mode, the time after which the pending calls are cancelled */
+    Ts mDrainDeadline = 0;
 /** This flag marks the end of the event loop and is set when all done() items
  * are resolved and all scheduled func calls have been executed */
 	int mComplete = 0;
 	std::string mErrorTag;
+/** Held by the loop, except while it waits for the next event, so that other threads can
+ * post() calls and wakeup() the loop */
     std::mutex mMutex;
+    std::thread::id mLoopThread; //the one that created the loop and holds the mutex
+    DefaultLoopBackend mDefaultBackend;
+    LoopBackend* mBackend = &mDefaultBackend;
+/** Runs the next scheduled call if it's due, otherwise waits for it, but not past \c until,
+ * if non-zero. Returns false if there is nothing to wait for, or the loop completed */
+    bool step(Ts until);
 #ifndef TEST_HAVE_COLOR_VARS
     void initColors()
     {
@@ -174,16 +321,21 @@ private:
     EventLoop(const EventLoop&) = delete; //we don't want lambdas to make a copy of the async object by accident
 public:
     std::string errorMsg;
-    EventLoop(int timeout=TESTLOOP_DEFAULT_DONE_TIMEOUT)
+    EventLoop(int timeout=TESTLOOP_DEFAULT_DONE_TIMEOUT, SrcLoc loc=ASYNCTEST_CALLER_LOC)
     :defaultDoneTimeout(timeout)
     {
-        DoneItem item("_default");
+        setSeed(rand());
+        mMutex.lock();
+        mLoopThread = std::this_thread::get_id();
+        DoneItem item("_default", loc);
         addDoneToMap(std::move(item));
     }
     EventLoop(std::vector<DoneItem>&& doneItems, int timeout=TESTLOOP_DEFAULT_DONE_TIMEOUT)
     :defaultDoneTimeout(timeout)
     {
+        setSeed(rand());
         mMutex.lock();
+        mLoopThread = std::this_thread::get_id();
         for (auto& item: doneItems)
         {
             addDoneToMap(std::move(item));
@@ -199,6 +351,7 @@ public:
         auto result = mDones.insert(std::make_pair(item.tag, std::forward<DoneItem>(item)));
         if (!result.second)
             usageError("addDone: Duplicate done() tag '"+item.tag+"'");
+        mNumDonesPending++;
         //we don't add the done item to the loop here because the deadline timestamps
         //will be set just before the loop is run
         return result.first->second;
@@ -228,8 +381,11 @@ public:
                 TESTLOOP_LOG_DEBUG("done('%s') timeout handler: done is resolved", tag.c_str());
                 return;
             }
-            doError("Timeout", it->first, true);
+            TESTLOOP_TRACE_INSTANT("timeout", "timeout('"+tag+"')");
+            it->second.complete = ASYNC_COMPLETE_ERROR; //for describeState()
+            doError("Timeout\n"+describeState(), it->first, true);
         }, item.deadline);
+        item.schedItem->second->doneTag = item.tag.c_str();
     }
     ~EventLoop()
 	{
@@ -253,45 +409,135 @@ public:
         TESTLOOP_LOG_ERROR("Usage error: %s", msg.c_str());
 		throw std::runtime_error(msg);
 	}
+/** Seeds the random generator that determines the jitter of the scheduled calls. The same
+ * seed results in the same sequence of delays, which allows reproducing timing-dependent failures */
+    void setSeed(unsigned aSeed)
+    {
+        seed = aSeed;
+        mRandState = aSeed;
+    }
+/** Returns the next number from the loop's random generator (splitmix64) */
+    uint32_t nextRandom()
+    {
+        uint64_t z = (mRandState += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return (uint32_t)((z ^ (z >> 31)) >> 32);
+    }
+    Ts addJitter(Ts ts, int after, int aJitterPct)
+    {
+        int j = (after * aJitterPct) / 100;
+        if (j)
+            ts += ((int)(nextRandom() % (2*j)) - j);
+        return ts;
+    }
+/** Computes the nominal (without jitter) due time of a call scheduled with the specified delay.
+ * If \c after is negative, the delay is relative to the last ordered call */
+    Ts nominalTs(int after)
+    {
+        if (after >= 0)
+            return getTimeMs()+after;
+        if (!mLastOrderTs)
+            mLastOrderTs = getTimeMs();
+        return mLastOrderTs-after; //after is negative
+    }
+/** Schedules a function to be called after \c after ms, with a random jitter of \c aJitterPct
+ * percent of the delay. If \c after is negative, the call is ordered: it is scheduled -after
+ * ms after the previous ordered call. The location of the caller is recorded automatically,
+ * for the diagnostics */
     template <class CB>
-    void schedCall(CB&& func, int after=100, int aJitterPct = -1)
+    SchedHandle schedCall(CB&& func, int after=100, int aJitterPct = -1,
+        SrcLoc loc=ASYNCTEST_CALLER_LOC)
 	{
         if (aJitterPct < 0)
             aJitterPct = jitterPct;
-        Ts ts;
+        Ts ts = addJitter(nominalTs(after), std::abs(after), aJitterPct);
         if (after < 0) //ordered call: schedule -after ms after the previous ordered call
-		{
-            after = -after;
-            if (!mLastOrderTs)
-                mLastOrderTs = getTimeMs();
-            ts = mLastOrderTs+after; //after is negative
-            if (aJitterPct)
-            {
-                int j = (after*aJitterPct)/100;
-                ts += ((rand() % (2*j)) - j);
-            }
             mLastOrderTs = ts;
-		}
-		else
-        {
-            ts = getTimeMs()+after;
-            if (aJitterPct)
-            {
-                int j = (after * aJitterPct) / 100;
-                ts += ((rand()% (2*j)) - j);
-            }
-        }
-        schedHandler(std::forward<CB>(func), ts);
+        mRecorder.add(FlightRecorder::kSchedule, mIterationTs, ts, nullptr, loc);
+        return SchedHandle(*this, schedHandler(std::forward<CB>(func), ts, loc)->second);
+    }
+/** Schedules a function to be called repeatedly, every \c interval ms. The deadlines are
+ * computed relative to the first one, so they don't drift, regardless of the jitter and of
+ * the time the function takes to execute. If the loop falls behind by more than a period,
+ * the missed calls are skipped. If \c interval is negative, the first call is scheduled as an
+ * ordered call (see schedCall()), and the following ones are -interval ms apart.
+ * Periodic calls don't keep the loop running once all done() items are resolved - they
+ * are stopped via the returned handle, or when the loop completes.
+ */
+    template <class CB>
+    SchedHandle schedPeriodic(CB&& func, int interval, int aJitterPct = -1,
+        SrcLoc loc=ASYNCTEST_CALLER_LOC)
+    {
+        if (!interval)
+            usageError("schedPeriodic: interval must not be zero");
+        if (aJitterPct < 0)
+            aJitterPct = jitterPct;
+        bool ordered = (interval < 0);
+        Ts nominal = nominalTs(interval);
+        interval = std::abs(interval);
+        Ts ts = addJitter(nominal, interval, aJitterPct);
+        if (ordered) //only the first call takes part in the ordered sequence
+            mLastOrderTs = ts;
+        auto item = std::make_shared<SchedItem<typename std::decay<CB>::type> >(std::forward<CB>(func));
+        item->nominalTs = nominal;
+        item->interval = interval;
+        item->jitterPct = aJitterPct;
+        item->loc = loc;
+        mRecorder.add(FlightRecorder::kSchedule, mIterationTs, ts, nullptr, loc);
+        enqueue(item, ts);
+        return SchedHandle(*this, item);
     }
     template <class CB>
-    SchedQueue::iterator schedHandler(CB&& handler, Ts ts)
+    SchedQueue::iterator schedHandler(CB&& handler, Ts ts, const SrcLoc& loc=SrcLoc())
     {
-        auto ret = mSchedQueue.emplace(ts, std::make_shared<SchedItem<CB> >(
-            std::forward<CB>(handler)));
+        auto item = std::make_shared<SchedItem<typename std::decay<CB>::type> >(
+            std::forward<CB>(handler));
+        item->loc = loc;
+        return enqueue(item, ts);
+	}
+    SchedQueue::iterator enqueue(const std::shared_ptr<SchedItemBase>& item, Ts ts)
+    {
+        item->ts = ts;
+        if (!item->createdTs)
+            item->createdTs = mIterationTs;
+        auto ret = mSchedQueue.emplace(ts, item);
+        if (item->interval)
+            mNumPeriodic++;
         if (ts < mNextEventTs)
             setWakeupTs(ts);
         return ret;
-	}
+    }
+/** Removes the entry at \c it from the sched queue */
+    void unqueue(SchedQueue::iterator it)
+    {
+        if (it->second->interval)
+            mNumPeriodic--;
+        mSchedQueue.erase(it);
+    }
+    void cancelItem(const std::shared_ptr<SchedItemBase>& item)
+    {
+        item->pending = false;
+        auto range = mSchedQueue.equal_range(item->ts);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (it->second == item)
+            {
+                unqueue(it);
+                return;
+            }
+        }
+        //not in the queue - a periodic call that is being executed, will not be rescheduled
+    }
+/** Schedules the next call of a periodic item, after it has been executed */
+    void reschedule(const std::shared_ptr<SchedItemBase>& item)
+    {
+        item->nominalTs += item->interval;
+        auto now = getTimeMs();
+        if (item->nominalTs < now - item->interval) //fell behind, skip the missed calls
+            item->nominalTs += ((now - item->nominalTs) / item->interval) * item->interval;
+        enqueue(item, addJitter(item->nominalTs, item->interval, item->jitterPct));
+    }
     void setWakeupTs(Ts& ts)
     {
         mNextEventTs = ts;
@@ -307,44 +553,95 @@ public:
         }
     }
 
-    void run()
-	{
-#ifndef TEST_HAVE_COLOR_VARS
-        initColors();
-#endif
-        if (mSchedQueue.empty())
-            throw std::runtime_error("Nothing to run: not even a single function call has been scheduled");
-        addAllDonesToLoop();
-        while (!mSchedQueue.empty() && !mComplete)
-		{
-            TESTLOOP_LOG_DEBUG("Pending events: %zu", mSchedQueue.size());
-            auto sched = mSchedQueue.begin();
-            auto timeToSleep = sched->first - getTimeMs();
-            if (timeToSleep > 0)
-            {
-                MutexUnlocker unlock(mMutex);
-                TESTLOOP_LOG_DEBUG("Sleeping %lld ms before next event", timeToSleep);
-                sleep(timeToSleep);
-            }
-            else
-            {
-                TESTLOOP_LOG_DEBUG("Negative or zero time to next event: %lld", timeToSleep);
-            }
-            if (sched->first - getTimeMs() > 2)
-            {
-                TESTLOOP_LOG_DEBUG("Woke up before next event time, will sleep again");
-                continue; //slept less than required, repeat
-            }
-            auto call = sched->second;
-            mSchedQueue.erase(sched);
-            (*call)();
-            if (!errorMsg.empty())
-                break;
+    void run();
+/** Runs the loop nested, from within a scheduled call (i.e. the test body), until \c pred
+ * returns true. This allows waiting for a condition in the middle of a test body, without
+ * splitting it into chained calls. Meanwhile, the scheduled calls and the done() timeouts are
+ * processed as usual, and \c pred is evaluated after each call, and when another thread calls
+ * wakeup() or post() - there is no polling.
+ * @param timeoutMs The maximum time to wait, or -1 to wait until the loop completes, i.e.
+ * due to a done() timeout
+ * @returns Whether \c pred returned true. False if the timeout elapsed, the loop completed or
+ * an error occurred, in which case the caller should return */
+    template <class Pred>
+    bool runUntil(Pred&& pred, int timeoutMs=-1)
+    {
+        if (!mStartTs)
+            usageError("runUntil() and waitFor() can be called only while the loop is running");
+        Ts until = (timeoutMs >= 0) ? getTimeMs() + timeoutMs : 0;
+        TESTLOOP_TRACE_SCOPE("loop", "runUntil");
+        for (;;)
+        {
+            if (pred())
+                return true;
+            if (mComplete || !errorMsg.empty() || (until && getTimeMs() >= until))
+                return false;
+            if (!step(until))
+                return pred();
         }
-        if (!mComplete) //sched queue got empty, all is done
-            mComplete = ASYNC_COMPLETE_SUCCESS;
-	}
-	void done(const std::string& tag)
+    }
+/** Runs the loop nested until the done() item with the specified tag is resolved, see runUntil().
+ * @returns Whether the item was resolved successfully */
+    bool waitFor(const std::string& tag, int timeoutMs=-1)
+    {
+        auto it = mDones.find(tag);
+        if (it == mDones.end())
+            usageError("waitFor: Unknown done() tag '"+tag+"'");
+        auto& item = it->second;
+        runUntil([&item]() { return item.complete != ASYNC_COMPLETE_NOT; }, timeoutMs);
+        return item.complete == ASYNC_COMPLETE_SUCCESS;
+    }
+/** Makes a waiting loop re-evaluate the predicate of runUntil(). Thread-safe. Blocks while
+ * the loop is executing a call */
+    void wakeup()
+    {
+        if (std::this_thread::get_id() == mLoopThread)
+        {
+            mBackend->wakeup();
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mMutex);
+        mBackend->wakeup();
+    }
+/** Schedules a call to be executed as soon as possible, and wakes up the loop. Unlike
+ * schedCall(), it can be called from any thread. Blocks while the loop is executing a call */
+    template <class CB>
+    SchedHandle post(CB&& func, SrcLoc loc=ASYNCTEST_CALLER_LOC)
+    {
+        if (std::this_thread::get_id() == mLoopThread)
+            return schedCall(std::forward<CB>(func), 0, 0, loc);
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto ts = getTimeMs();
+        mRecorder.add(FlightRecorder::kSchedule, ts, ts, nullptr, loc);
+        auto handle = SchedHandle(*this, schedHandler(std::forward<CB>(func), ts, loc)->second);
+        mBackend->wakeup();
+        return handle;
+    }
+/** Makes the loop wait for its events via the specified backend, i.e. an adapter to an
+ * external reactor, instead of the default one. The backend is not owned by the loop, and
+ * nullptr restores the default. Can be called also while the loop is running, i.e. from the
+ * test body */
+    void setBackend(LoopBackend* backend)
+    {
+        mBackend = backend ? backend : &mDefaultBackend;
+    }
+    LoopBackend& backend() { return *mBackend; }
+/** The total time, in milliseconds, that the loop spent waiting for its next event (including
+ * whatever an external backend does while waiting), as opposed to executing the scheduled calls */
+    Ts waitTimeMs() const { return mWaitMs; }
+/** Describes the state of the loop - the done() items and the pending scheduled calls, with
+ * the places where they were scheduled. Included in the error message when a done() item
+ * times out. The times are relative to the start of the loop.
+ * @param maxCalls The maximum number of pending calls to list */
+    std::string describeState(size_t maxCalls=20);
+/** The most recent events of the loop, from its flight recorder, one per line. Empty if the
+ * loop has not been run */
+    std::string formatEvents() const
+    {
+        return mStartTs ? mRecorder.format(mStartTs) : std::string();
+    }
+    const FlightRecorder& flightRecorder() const { return mRecorder; }
+	void done(const std::string& tag, SrcLoc loc=ASYNCTEST_CALLER_LOC)
 	{
 		auto it = mDones.find(tag);
 		if (it == mDones.end())
@@ -354,34 +651,59 @@ public:
 		}
 		if (it->second.complete)
 		{
-            doError("done() already resloved, can't resolve again", tag, true);
+            std::string where = it->second.resolvedLoc.toString();
+            doError(where.empty() ? "done() already resolved, can't resolve again"
+                : "done() already resolved at " + where + ", can't resolve again", tag, true, loc);
 			return;
 		}
-        mSchedQueue.erase(it->second.schedItem); //even if out of order, doesnt matter, as we are exiting the loop anyway, but for consistency
+        unqueue(it->second.schedItem); //even if out of order, doesnt matter, as we are exiting the loop anyway, but for consistency
         auto order = it->second.order;
         if (order && (order != ++mLastOrderedDoneNo))
 		{
             doError("Did not resolve in expected order. Expected: "+
              std::to_string(order)+", actual: "+
-             std::to_string(mLastOrderedDoneNo), it->first, true);
+             std::to_string(mLastOrderedDoneNo), it->first, true, loc);
 			return;
 		}
 
 		it->second.complete = ASYNC_COMPLETE_SUCCESS;
+        it->second.resolvedLoc = loc;
+        mRecorder.add(FlightRecorder::kDone, mIterationTs, 0, it->first.c_str(), loc);
         TESTLOOP_LOG_DONE("done('\%s%s\%s') -> %ssuccess%s", kColorTag, tag.c_str(),
             kColorNormal, kColorSuccess, kColorNormal);
+        TESTLOOP_TRACE_INSTANT("done", "done('"+tag+"') "+loc.toString());
+        if (--mNumDonesPending == 0 && completeOnDones)
+            onAllDonesResolved();
+    }
+    void onAllDonesResolved()
+    {
+        if (completeGraceMs <= 0)
+        {
+            if (!mComplete)
+                mComplete = ASYNC_COMPLETE_SUCCESS;
+            return;
+        }
+        mDrainDeadline = getTimeMs() + completeGraceMs;
+        TESTLOOP_LOG_DEBUG("All dones resolved, draining pending calls for up to %d ms", completeGraceMs);
     }
 
-	void done()
+	void done(SrcLoc loc=ASYNCTEST_CALLER_LOC)
 	{
-        done("_default");
+        done("_default", loc);
 	}
-    void doError(const std::string& msg, const std::string& tag, bool noThrow=false)
+    void doError(const std::string& msg, const std::string& tag, bool noThrow=false,
+        const SrcLoc& loc=SrcLoc())
 	{
         if (mComplete == ASYNC_COMPLETE_ERROR)
             return;
 
 		mComplete = ASYNC_COMPLETE_ERROR;
+        {
+            auto it = tag.empty() ? mDones.end() : mDones.find(tag);
+            mRecorder.add(FlightRecorder::kError, mIterationTs, 0,
+                (it != mDones.end()) ? it->first.c_str() : nullptr, loc);
+        }
+        TESTLOOP_TRACE_INSTANT("error", tag.empty() ? msg : ("error('"+tag+"'): "+msg));
         if (!tag.empty())
         {
             auto it = mDones.find(tag);
@@ -392,6 +714,8 @@ public:
             errorMsg.append(kColorTag).append(tag).append(kColorNormal)
                    .append("'): ").append(msg);
             it->second.complete = ASYNC_COMPLETE_ERROR;
+            if (loc.isKnown())
+                it->second.resolvedLoc = loc;
             TESTLOOP_LOG_DONE("%s", errorMsg.c_str());
             if (!noThrow)
                 throw std::runtime_error(errorMsg); //propagate to unit test framework to handle
@@ -405,15 +729,15 @@ public:
                 throw std::runtime_error(msg);
         }
 	}
-	void error(const std::string& msg)
+	void error(const std::string& msg, SrcLoc loc=ASYNCTEST_CALLER_LOC)
 	{
-        doError(msg, "_default");
+        doError(msg, "_default", false, loc);
     }
-    void error(const std::string& tag, const std::string& msg)
+    void error(const std::string& tag, const std::string& msg, SrcLoc loc=ASYNCTEST_CALLER_LOC)
     {
         if (tag.empty())
             usageError("error() for a tagged done() item called, but the tag is empty");
-        doError(msg, tag);
+        doError(msg, tag, false, loc);
     }
 
 	static inline const char* completeCodeToString(int code)
@@ -429,6 +753,200 @@ public:
 		return strings[code];
 	}
 };
+
+#ifdef ASYNCTEST_COMPILE_IMPL
+ASYNCTEST_INLINE void EventLoop::run()
+{
+#ifndef TEST_HAVE_COLOR_VARS
+    initColors();
+#endif
+    if (mSchedQueue.empty())
+        throw std::runtime_error("Nothing to run: not even a single function call has been scheduled");
+    TESTLOOP_TRACE_SCOPE("loop", "run");
+    mStartTs = mIterationTs = getTimeMs();
+    addAllDonesToLoop();
+    while (!mSchedQueue.empty() && !mComplete)
+	{
+        TESTLOOP_LOG_DEBUG("Pending events: %zu", mSchedQueue.size());
+        if (!mNumDonesPending && mSchedQueue.size() == mNumPeriodic)
+        {
+            TESTLOOP_LOG_DEBUG("All dones resolved, only periodic calls remain");
+            break;
+        }
+        if (!step(0) || !errorMsg.empty())
+            break;
+    }
+    if (!mComplete) //sched queue got empty, all is done
+        mComplete = ASYNC_COMPLETE_SUCCESS;
+    mSchedQueue.clear(); //cancel calls that are still pending, if we completed early
+    mNumPeriodic = 0;
+}
+
+ASYNCTEST_INLINE bool EventLoop::step(Ts until)
+{
+    Ts wakeTs = until;
+    if (!mSchedQueue.empty())
+    {
+        auto next = mSchedQueue.begin()->first;
+        if (mDrainDeadline && next > mDrainDeadline)
+        {
+            TESTLOOP_LOG_DEBUG("All dones resolved, cancelling %zu pending call(s)", mSchedQueue.size());
+            mComplete = ASYNC_COMPLETE_SUCCESS;
+            return false;
+        }
+        if (!until || next < until)
+            wakeTs = next;
+    }
+    else if (!until)
+    {
+        return false;
+    }
+    auto now = getTimeMs();
+    auto timeToSleep = wakeTs - now;
+    if (timeToSleep > 0)
+    {
+        mRecorder.add(FlightRecorder::kSleep, now, timeToSleep, nullptr);
+        TESTLOOP_LOG_DEBUG("Sleeping %lld ms before next event", timeToSleep);
+        TESTLOOP_TRACE_SCOPE("loop", "sleep");
+        mBackend->wait(timeToSleep, mMutex);
+        auto before = now;
+        now = getTimeMs();
+        mWaitMs += now - before;
+    }
+    else
+    {
+        TESTLOOP_LOG_DEBUG("Negative or zero time to next event: %lld", timeToSleep);
+    }
+    if (mSchedQueue.empty())
+        return true;
+    auto sched = mSchedQueue.begin(); //a call may have been posted while waiting
+    if (sched->first - now > 2)
+    {
+        TESTLOOP_LOG_DEBUG("Woke up before next event time");
+        return true;
+    }
+    auto call = sched->second;
+    unqueue(sched);
+    if (!call->interval)
+        call->pending = false; //it can't be cancelled or run again from now on
+    mIterationTs = now;
+    if (call->doneTag)
+        mRecorder.add(FlightRecorder::kDoneTimeout, now, call->ts, call->doneTag);
+    else
+        mRecorder.add(FlightRecorder::kCall, now, call->ts, nullptr, call->loc);
+    {
+        TESTLOOP_TRACE_SCOPE_AT("loop", "call", call->loc);
+        (*call)();
+    }
+    if (call->interval && call->pending && !mComplete && errorMsg.empty())
+        reschedule(call);
+    return true;
+}
+
+ASYNCTEST_INLINE std::string EventLoop::describeState(size_t maxCalls)
+{
+    auto now = getTimeMs();
+    auto start = mStartTs ? mStartTs : now;
+    char buf[256];
+    std::string items; //counted from the states, mNumDonesPending still includes a timed out item
+    size_t numPending = 0;
+    for (auto& item: mDones)
+    {
+        auto& done = item.second;
+        items.append("\n    '").append(item.first).append("': ");
+        if (done.complete == ASYNC_COMPLETE_SUCCESS)
+            items.append("resolved");
+        else if (done.complete == ASYNC_COMPLETE_ERROR)
+            items.append("failed");
+        else
+        {
+            items.append("pending");
+            numPending++;
+        }
+        FlightRecorder::appendLoc(items, "at", done.resolvedLoc);
+        items.append(", deadline +").append(std::to_string(done.deadline - start)).append(" ms");
+        if (done.order)
+            items.append(", order ").append(std::to_string(done.order));
+        if (done.loc.isKnown())
+            items.append(", declared at ").append(done.loc.toString());
+    }
+    snprintf(buf, sizeof(buf), "Loop state at +%lld ms:\n  done() items (%zu of %zu pending):",
+        now - start, numPending, mDones.size());
+    std::string result(buf);
+    result.append(items);
+    snprintf(buf, sizeof(buf), "\n  scheduled calls (%zu pending):", mSchedQueue.size());
+    result.append(buf);
+    size_t num = 0;
+    for (auto& entry: mSchedQueue)
+    {
+        if (num++ >= maxCalls)
+        {
+            snprintf(buf, sizeof(buf), "\n    ...and %zu more", mSchedQueue.size() - maxCalls);
+            result.append(buf);
+            break;
+        }
+        auto& call = *entry.second;
+        snprintf(buf, sizeof(buf), "\n    due +%lld ms (in %lld ms)", call.ts - start, call.ts - now);
+        result.append(buf);
+        if (call.createdTs > start)
+            result.append(", scheduled at +").append(std::to_string(call.createdTs - start)).append(" ms");
+        if (call.doneTag)
+            result.append(", timeout of done('").append(call.doneTag).append("')");
+        if (call.interval)
+            result.append(", periodic every ").append(std::to_string(call.interval)).append(" ms");
+        FlightRecorder::appendLoc(result, "from", call.loc);
+    }
+    return result;
+}
+
+ASYNCTEST_INLINE std::string FlightRecorder::format(Ts startTs, const char* indent) const
+{
+    unsigned num = (mCount < kSize) ? mCount : (unsigned)kSize;
+    char buf[128];
+    snprintf(buf, sizeof(buf), "Last %u of %u loop events:", num, mCount);
+    std::string result(buf);
+    for (unsigned i = mCount - num; i != mCount; i++)
+    {
+        auto& event = mEvents[i % kSize];
+        if (event.ts >= startTs)
+            snprintf(buf, sizeof(buf), "\n%s+%lld ms ", indent, event.ts - startTs);
+        else //scheduled before the loop was started
+            snprintf(buf, sizeof(buf), "\n%sbefore run: ", indent);
+        result.append(buf);
+        switch (event.type)
+        {
+        case kSchedule:
+            result.append("schedule call");
+            appendLoc(result, "from", SrcLoc(event.file, event.line));
+            result.append(", due +").append(std::to_string(event.arg - startTs)).append(" ms");
+            break;
+        case kCall:
+            result.append("call");
+            appendLoc(result, "from", SrcLoc(event.file, event.line));
+            result.append(", due +").append(std::to_string(event.arg - startTs)).append(" ms");
+            break;
+        case kDoneTimeout:
+            result.append("timeout handler of done('").append(event.tag).append("'), due +")
+                  .append(std::to_string(event.arg - startTs)).append(" ms");
+            break;
+        case kDone:
+            result.append("done('").append(event.tag).append("')");
+            appendLoc(result, "at", SrcLoc(event.file, event.line));
+            break;
+        case kError:
+            result.append("error");
+            if (event.tag)
+                result.append(" in done('").append(event.tag).append("')");
+            appendLoc(result, "at", SrcLoc(event.file, event.line));
+            break;
+        case kSleep:
+            result.append("sleep ").append(std::to_string(event.arg)).append(" ms");
+            break;
+        }
+    }
+    return result;
+}
+#endif
 }
 #endif // ASYNCTEST_H
 
@@ -0,0 +1,60 @@
+/** @file The interface via which the event loop waits for its next event, which allows running
+ *  async tests on top of an external reactor, i.e. the event loop of the code under test
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_LOOPBACKEND_H
+#define ASYNCTEST_LOOPBACKEND_H
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+namespace test
+{
+/** The part of EventLoop that waits for the next event. The loop itself keeps track of the
+ * scheduled calls (its timers), the done() items with their timeouts and order, and of the
+ * calls posted from other threads, and calls wait() with the time until its next scheduled call.
+ * An adapter to an external reactor dispatches the reactor's own events (I/O, its timers)
+ * while waiting, so that the test and the code under test run on a single thread, without
+ * polling and without hops between threads. Set via EventLoop::setBackend()
+ */
+class LoopBackend
+{
+public:
+    virtual ~LoopBackend() {}
+/** Waits up to \c ms milliseconds, or until wakeup() is called, and dispatches the events of
+ * the reactor that occur meanwhile. Called with \c loopMutex locked. The mutex has to be
+ * unlocked while blocking (i.e. in poll()), so that other threads can post() calls to the loop,
+ * and locked while dispatching events, as their handlers may use the loop, i.e. call done().
+ * It may return early, i.e. after dispatching an event - the loop then checks whether its
+ * next call is due, and waits again */
+    virtual void wait(long long ms, std::mutex& loopMutex) = 0;
+/** Makes a pending or an ongoing wait() return. Called with the loop mutex locked, from any
+ * thread, including from the handlers of the reactor's events */
+    virtual void wakeup() = 0;
+};
+
+/** The backend used by default - waits on a condition variable, and doesn't dispatch any
+ * other events */
+class DefaultLoopBackend: public LoopBackend
+{
+protected:
+    std::condition_variable mCond;
+    bool mWoken = false;
+public:
+    virtual void wait(long long ms, std::mutex& loopMutex)
+    {
+        std::unique_lock<std::mutex> lock(loopMutex, std::adopt_lock);
+        mCond.wait_for(lock, std::chrono::milliseconds(ms), [this]() { return mWoken; });
+        mWoken = false;
+        lock.release(); //the loop keeps holding it
+    }
+    virtual void wakeup()
+    {
+        mWoken = true;
+        mCond.notify_one();
+    }
+};
+}
+#endif
@@ -0,0 +1,219 @@
+/** @file Runtime options of the async unit testing framework
+ *  Options can be passed on the command line of the test executable via
+ *  \c test::gOptions.parse(argc, argv), or via the ASYNCTEST_ARGS environment variable,
+ *  which is parsed automatically at startup.
+ */
+
+#ifndef ASYNCTEST_OPTIONS_H
+#define ASYNCTEST_OPTIONS_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <thread>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fnmatch.h>
+
+namespace test
+{
+struct Options
+{
+/** File with the performance baseline to compare the current run against (--baseline=FILE) */
+    std::string baselineFile;
+/** File to which to save the per-test metrics of the current run (--save-baseline=FILE).
+ * If the file exists, the new values are folded into the statistics stored in it */
+    std::string baselineSaveFile;
+/** Max allowed slowdown relative to the baseline mean, in percent (--regress-pct=N) */
+    double regressPct = 10;
+/** If non-zero, a slowdown is a regression only if it is also more than this many
+ * standard deviations above the baseline mean (--regress-sigma=N) */
+    double regressSigma = 3;
+/** Absolute differences below this value are considered noise (--regress-min=N). Time
+ * metrics have a higher noise floor of their own, see PerfBaseline::noiseFloor() */
+    double regressMinDelta = 1;
+/** Metrics whose baseline has fewer saved runs than this are not compared, as their
+ * mean and deviation are not yet meaningful (--regress-min-runs=N) */
+    unsigned regressMinRuns = 3;
+/** File with the execution time history of the tests (--durations=FILE). It is used to
+ * run the longest tests first and to balance the shards, and is updated after the run,
+ * unless the run is sharded */
+    std::string durationsFile;
+/** File to which to write the updated history (--durations-out=FILE), instead of the
+ * --durations file. If it doesn't exist, it starts as a copy of the history */
+    std::string durationsOutFile;
+/** Run only the tests of shard \c shardIndex out of \c shardCount (--shard=K/N, K is zero-based) */
+    unsigned shardIndex = 0;
+    unsigned shardCount = 1;
+/** Max number of tests of a group that are run in parallel, each in a separate
+ * forked process (--jobs=N). --jobs=0 means the number of CPU cores. If not set, the
+ * tests are run sequentially, except in repeat mode, where all cores are used */
+    unsigned jobs = 0;
+/** Colon-separated list of wildcard patterns (as for fnmatch()) of the full names
+ * (group/test) of the tests to run (--filter=PATTERNS) */
+    std::string filter;
+/** Repeat mode: run each selected test this many times, each time in a separate process and
+ * with a different random seed, in order to detect flaky tests (--repeat=N) */
+    unsigned repeat = 0;
+/** Repeat mode: stop repeating a test after its first failure (--until-fail). If --repeat
+ * is not given, the test is repeated until it fails */
+    bool untilFail = false;
+/** The seed of the random generators of the tests, i.e. the one that determines the
+ * schedCall() jitter (--seed=N). If negative, a random seed is used for each test */
+    long long seed = -1;
+/** File to which to write a Chrome trace (JSON) of the test run (--trace=FILE) */
+    std::string traceFile;
+/** Measure the hardware performance counters (cycles, instructions, cache and branch misses)
+ * of each test, report them and compare them against the performance baseline (--perf-counters) */
+    bool perfCounters = false;
+/** Default number of random cases of property checks (--prop-cases=N). Properties that set
+ * the number of cases explicitly are not affected */
+    size_t propertyCases = 0;
+/** Max number of failures of the non-fatal expect() checks of a test whose values are
+ * reported (--expect-limit=N). Failures beyond that are only counted */
+    size_t expectLimit = 100;
+/** Default timeout of synchronous and stress tests, in milliseconds (--sync-timeout=MS).
+ * Zero disables it. See Test::timeout() */
+    int syncTimeoutMs = 60000;
+/** Install signal handlers that report a crash of the test process, see CrashHandler.
+ * Disabled by --no-crash-handler */
+    bool crashHandler = true;
+/** Print a breakdown of the time of the run at the end - the slowest and the most idle
+ * tests, and the critical path, see TimeReport (--time-report[=N]). N is the number of
+ * tests listed in each ranking, 10 by default. Zero disables the report */
+    size_t timeReport = 0;
+    bool isRepeating() const { return repeat > 1 || untilFail; }
+    static unsigned numCpus() { return std::max(1u, std::thread::hardware_concurrency()); }
+/** The number of worker processes to use, 1 meaning that tests run in the main process */
+    unsigned numJobs() const
+    {
+        if (jobs)
+            return jobs;
+        return isRepeating() ? numCpus() : 1;
+    }
+    bool isSelected(const std::string& fullName) const
+    {
+        if (filter.empty())
+            return true;
+        size_t pos = 0;
+        for (;;)
+        {
+            auto end = filter.find(':', pos);
+            auto pattern = filter.substr(pos, (end == std::string::npos) ? std::string::npos : end - pos);
+            if (fnmatch(pattern.c_str(), fullName.c_str(), 0) == 0)
+                return true;
+            if (end == std::string::npos)
+                return false;
+            pos = end + 1;
+        }
+    }
+
+    static bool startsWith(const std::string& str, const char* prefix, std::string& value)
+    {
+        size_t len = strlen(prefix);
+        if (str.compare(0, len, prefix) != 0)
+            return false;
+        value = str.substr(len);
+        return true;
+    }
+    static double toNumber(const std::string& opt, const std::string& val)
+    {
+        char* end;
+        double ret = strtod(val.c_str(), &end);
+        if (val.empty() || *end)
+            throw std::runtime_error("Option "+opt+" requires a numeric value, got '"+val+"'");
+        return ret;
+    }
+/** Parses a single option. Returns false if the option is not recognized */
+    bool parseOne(const std::string& arg)
+    {
+        std::string val;
+        if (startsWith(arg, "--baseline=", val))
+            baselineFile = val;
+        else if (startsWith(arg, "--save-baseline=", val))
+            baselineSaveFile = val;
+        else if (startsWith(arg, "--regress-pct=", val))
+            regressPct = toNumber("--regress-pct", val);
+        else if (startsWith(arg, "--regress-sigma=", val))
+            regressSigma = toNumber("--regress-sigma", val);
+        else if (startsWith(arg, "--regress-min=", val))
+            regressMinDelta = toNumber("--regress-min", val);
+        else if (startsWith(arg, "--regress-min-runs=", val))
+            regressMinRuns = (unsigned)toNumber("--regress-min-runs", val);
+        else if (startsWith(arg, "--durations=", val))
+            durationsFile = val;
+        else if (startsWith(arg, "--durations-out=", val))
+            durationsOutFile = val;
+        else if (startsWith(arg, "--shard=", val))
+        {
+            if (sscanf(val.c_str(), "%u/%u", &shardIndex, &shardCount) != 2
+             || !shardCount || shardIndex >= shardCount)
+                throw std::runtime_error("Option --shard requires a value in the form K/N, with 0 <= K < N");
+        }
+        else if (startsWith(arg, "--jobs=", val))
+        {
+            jobs = (unsigned)toNumber("--jobs", val);
+            if (!jobs)
+                jobs = numCpus();
+        }
+        else if (startsWith(arg, "--filter=", val))
+            filter = val;
+        else if (startsWith(arg, "--repeat=", val))
+            repeat = (unsigned)toNumber("--repeat", val);
+        else if (arg == "--until-fail")
+            untilFail = true;
+        else if (startsWith(arg, "--seed=", val))
+            seed = (long long)toNumber("--seed", val);
+        else if (startsWith(arg, "--trace=", val))
+            traceFile = val;
+        else if (arg == "--perf-counters")
+            perfCounters = true;
+        else if (startsWith(arg, "--prop-cases=", val))
+            propertyCases = (size_t)toNumber("--prop-cases", val);
+        else if (startsWith(arg, "--expect-limit=", val))
+            expectLimit = (size_t)toNumber("--expect-limit", val);
+        else if (startsWith(arg, "--sync-timeout=", val))
+            syncTimeoutMs = (int)toNumber("--sync-timeout", val);
+        else if (arg == "--no-crash-handler")
+            crashHandler = false;
+        else if (arg == "--time-report")
+            timeReport = 10;
+        else if (startsWith(arg, "--time-report=", val))
+            timeReport = (size_t)toNumber("--time-report", val);
+        else
+            return false;
+        return true;
+    }
+/** Parses the framework's options from the command line. Arguments that are not
+ * recognized are ignored, so that the application can have its own options */
+    void parse(int argc, const char* const* argv)
+    {
+        for (int i = 1; i < argc; i++)
+            parseOne(argv[i]);
+    }
+/** Parses a whitespace-separated list of options from the specified environment variable */
+    void parseEnv(const char* name="ASYNCTEST_ARGS")
+    {
+        const char* env = getenv(name);
+        if (!env)
+            return;
+        std::string str(env);
+        size_t pos = 0;
+        for (;;)
+        {
+            auto start = str.find_first_not_of(" \t", pos);
+            if (start == std::string::npos)
+                break;
+            pos = str.find_first_of(" \t", start);
+            auto arg = str.substr(start, (pos == std::string::npos) ? std::string::npos : pos-start);
+            if (!parseOne(arg))
+                fprintf(stderr, "%s: Ignoring unknown option '%s'\n", name, arg.c_str());
+            if (pos == std::string::npos)
+                break;
+        }
+    }
+};
+}
+#endif
@@ -0,0 +1,318 @@
+/** @file Storage of per-test performance metrics, and comparison against a saved baseline
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_PERFBASELINE_H
+#define ASYNCTEST_PERFBASELINE_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include "options.hpp"
+#include "asyncTestConfig.hpp"
+
+namespace test
+{
+/** Running statistics of a metric over several runs (Welford's algorithm) */
+struct MetricStat
+{
+    double count = 0;
+    double mean = 0;
+    double m2 = 0;
+    void add(double val)
+    {
+        count++;
+        double delta = val - mean;
+        mean += delta / count;
+        m2 += delta * (val - mean);
+    }
+/** Folds the statistics of another set of samples into this one. If \c maxCount is
+ * non-zero, the weight of the already accumulated samples is limited to \c maxCount,
+ * so that the mean can follow slow changes in performance */
+    void merge(const MetricStat& other, double maxCount=0)
+    {
+        if (maxCount && count > maxCount)
+        {
+            m2 *= maxCount / count;
+            count = maxCount;
+        }
+        double n = count + other.count;
+        if (!n)
+            return;
+        double delta = other.mean - mean;
+        mean += delta * other.count / n;
+        m2 += other.m2 + delta * delta * count * other.count / n;
+        count = n;
+    }
+    double stddev() const { return (count > 1) ? sqrt(m2 / (count - 1)) : 0; }
+};
+
+/** A small text file database of metric statistics, keyed by a test key and a metric name.
+ * Each line of the file has the form:
+ * <metric> <TAB> <sample count> <TAB> <mean> <TAB> <M2> <TAB> <key>
+ * The key is last, so that it can contain any characters except a newline
+ */
+class MetricStore
+{
+public:
+    typedef std::pair<std::string, std::string> Key; //(test key, metric name)
+    typedef std::map<Key, MetricStat> Map;
+    Map items;
+    bool empty() const { return items.empty(); }
+    const MetricStat* find(const std::string& key, const std::string& metric) const
+    {
+        auto it = items.find(Key(key, metric));
+        return (it == items.end()) ? nullptr : &it->second;
+    }
+    void add(const std::string& key, const std::string& metric, double value)
+    {
+        items[Key(key, metric)].add(value);
+    }
+    void merge(const MetricStore& other, double maxCount=0)
+    {
+        for (auto& item: other.items)
+            items[item.first].merge(item.second, maxCount);
+    }
+/** Loads the store from a file. Returns false if the file can't be opened */
+    bool load(const std::string& fname);
+/** Saves the store to a file, by writing a temporary file and renaming it over the
+ * destination, so that a crash never leaves a truncated file behind */
+    void save(const std::string& fname) const;
+/** Folds the specified metrics into the store in file \c fname, creating it if it
+ * doesn't exist, with the contents of \c initial, if given. The file is locked during the
+ * update, so that several test processes (i.e. shards of the same suite) can update the
+ * same file concurrently */
+    static void update(const std::string& fname, const MetricStore& values, double maxCount,
+        const MetricStore* initial=nullptr);
+};
+
+/** Compares the metrics of the tests in the current run against a baseline file,
+ * and collects the current metrics in order to save them as a (new) baseline
+ */
+class PerfBaseline
+{
+public:
+    struct Change
+    {
+        std::string key;
+        std::string metric;
+        double base;
+        double value;
+        double pct;
+        bool regressed;
+    };
+/** Max weight of the previously saved runs when folding in the current run */
+    enum { kMaxHistoryCount = 10 };
+/** Changes of a metric smaller than \c abs, or than \c rel times the baseline mean, are noise */
+    struct NoiseFloor
+    {
+        double abs;
+        double rel;
+    };
+/** The noise floor of a metric. time_ms has a resolution of 1 ms, and includes the jitter of
+ * the scheduler and of the sleeps of the test, so a change of a few ms is noise even for a
+ * test that is otherwise steady. cpu_ms is measured more finely, but varies with the CPU
+ * frequency and the cache state, roughly proportionally to its value */
+    static NoiseFloor noiseFloor(const std::string& metric)
+    {
+        if (metric == "time_ms")
+            return NoiseFloor{3, 0};
+        if (metric == "cpu_ms")
+            return NoiseFloor{2, 0.2};
+        return NoiseFloor{0, 0};
+    }
+protected:
+    MetricStore mBase;
+    MetricStore mCurrent;
+    bool mBaseLoaded = false;
+    std::vector<Change> mChanges;
+    unsigned mNumCompared = 0;
+    unsigned mNumRegressions = 0;
+    unsigned mNumUnderSampled = 0;
+    const Options& mOptions;
+    void loadBase()
+    {
+        mBaseLoaded = true;
+        if (mOptions.baselineFile.empty())
+            return;
+        if (!mBase.load(mOptions.baselineFile))
+            printf("%sWARNING%s: Can't open performance baseline file '%s', not comparing\n",
+                kColorWarning, kColorNormal, mOptions.baselineFile.c_str());
+    }
+public:
+    PerfBaseline(const Options& opts): mOptions(opts) {}
+    bool isComparing() const { return !mOptions.baselineFile.empty(); }
+    bool isRecording() const { return !mOptions.baselineSaveFile.empty(); }
+    unsigned numRegressions() const { return mNumRegressions; }
+/** Compares a metric value with the baseline. Lower values are considered better.
+ * @returns An error message if the value is a regression, an empty string otherwise
+ */
+    std::string compare(const std::string& key, const std::string& metric, double value);
+/** Records a metric of the current run, to be saved as part of the new baseline */
+    void record(const std::string& key, const std::string& metric, double value)
+    {
+        if (isRecording())
+            mCurrent.add(key, metric, value);
+    }
+    void save();
+    void printSummary(size_t maxLines=20);
+};
+
+#ifdef ASYNCTEST_COMPILE_IMPL
+ASYNCTEST_INLINE bool MetricStore::load(const std::string& fname)
+{
+    FILE* file = fopen(fname.c_str(), "r");
+    if (!file)
+        return false;
+    char line[4096];
+    while (fgets(line, sizeof(line), file))
+    {
+        if (line[0] == '#')
+            continue;
+        auto len = strlen(line);
+        if (len && line[len-1] == '\n')
+            line[--len] = 0;
+        char metric[128];
+        MetricStat stat;
+        int keyOffset = -1;
+        if (sscanf(line, "%127[^\t]\t%lf\t%lf\t%lf\t%n",
+            metric, &stat.count, &stat.mean, &stat.m2, &keyOffset) < 4 || keyOffset < 0)
+            continue; //malformed line
+        items[Key(line+keyOffset, metric)] = stat;
+    }
+    fclose(file);
+    return true;
+}
+
+ASYNCTEST_INLINE void MetricStore::save(const std::string& fname) const
+{
+    std::string tmpName = fname + ".tmp";
+    FILE* file = fopen(tmpName.c_str(), "w");
+    if (!file)
+        throw std::runtime_error("Can't open file '"+tmpName+"' for writing");
+    fprintf(file, "# metric\tcount\tmean\tm2\tkey\n");
+    for (auto& item: items)
+    {
+        fprintf(file, "%s\t%.17g\t%.17g\t%.17g\t%s\n", item.first.second.c_str(),
+            item.second.count, item.second.mean, item.second.m2, item.first.first.c_str());
+    }
+    bool ok = (fclose(file) == 0);
+    if (!ok || rename(tmpName.c_str(), fname.c_str()))
+        throw std::runtime_error("Error writing file '"+fname+"'");
+}
+
+ASYNCTEST_INLINE void MetricStore::update(const std::string& fname, const MetricStore& values, double maxCount,
+    const MetricStore* initial)
+{
+    std::string lockName = fname + ".lock";
+    int lockFd = open(lockName.c_str(), O_CREAT | O_RDWR, 0644);
+    if (lockFd >= 0)
+        flock(lockFd, LOCK_EX);
+    MetricStore store;
+    if (!store.load(fname) && initial)
+        store.items = initial->items;
+    store.merge(values, maxCount);
+    try
+    {
+        store.save(fname);
+    }
+    catch(...)
+    {
+        if (lockFd >= 0)
+            close(lockFd);
+        throw;
+    }
+    if (lockFd >= 0)
+        close(lockFd); //releases the lock
+}
+
+ASYNCTEST_INLINE std::string PerfBaseline::compare(const std::string& key, const std::string& metric, double value)
+{
+    if (!mBaseLoaded)
+        loadBase();
+    auto stat = mBase.find(key, metric);
+    if (!stat || stat->count < 1)
+        return std::string();
+    if (stat->count < mOptions.regressMinRuns)
+    {
+        mNumUnderSampled++;
+        return std::string();
+    }
+    mNumCompared++;
+    double delta = value - stat->mean;
+    auto floor = noiseFloor(metric);
+    if (fabs(delta) < std::max(std::max(mOptions.regressMinDelta, floor.abs), floor.rel * stat->mean))
+        return std::string();
+    double pct = stat->mean ? (delta * 100 / stat->mean) : 100;
+    if (delta < 0)
+    {
+        if (-pct > mOptions.regressPct)
+            mChanges.push_back(Change{key, metric, stat->mean, value, pct, false});
+        return std::string();
+    }
+    if (pct <= mOptions.regressPct)
+        return std::string();
+    if (mOptions.regressSigma && stat->count > 1
+     && delta <= mOptions.regressSigma * stat->stddev())
+        return std::string();
+    mChanges.push_back(Change{key, metric, stat->mean, value, pct, true});
+    mNumRegressions++;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "Performance regression: %s = %.3g, baseline %.3g (+%.1f%%, max +%.1f%%)",
+        metric.c_str(), value, stat->mean, pct, mOptions.regressPct);
+    return buf;
+}
+
+ASYNCTEST_INLINE void PerfBaseline::save()
+{
+    if (!isRecording() || mCurrent.empty())
+        return;
+    MetricStore::update(mOptions.baselineSaveFile, mCurrent, kMaxHistoryCount);
+    printf("Saved %zu metric(s) to performance baseline '%s'\n", mCurrent.items.size(),
+        mOptions.baselineSaveFile.c_str());
+}
+
+ASYNCTEST_INLINE void PerfBaseline::printSummary(size_t maxLines)
+{
+    if (!isComparing())
+        return;
+    if (mNumUnderSampled)
+    {
+        printf("Performance vs baseline: %u metric(s) not compared, as the baseline has fewer than %u runs of them\n",
+            mNumUnderSampled, mOptions.regressMinRuns);
+    }
+    if (!mNumCompared)
+        return;
+    size_t numFaster = mChanges.size() - mNumRegressions;
+    printf("Performance vs baseline: %u metric(s) compared, %s%zu faster%s, %s%u regressed%s\n",
+        mNumCompared, numFaster ? kColorSuccess : "", numFaster, numFaster ? kColorNormal : "",
+        mNumRegressions ? kColorFail : "", mNumRegressions, mNumRegressions ? kColorNormal : "");
+    //show the regressions first, then the largest changes
+    std::sort(mChanges.begin(), mChanges.end(), [](const Change& a, const Change& b)
+    {
+        if (a.regressed != b.regressed)
+            return a.regressed;
+        return fabs(a.pct) > fabs(b.pct);
+    });
+    size_t cnt = std::min(maxLines, mChanges.size());
+    for (size_t i = 0; i < cnt; i++)
+    {
+        auto& change = mChanges[i];
+        printf("  %s%-9s%s %+6.1f%%  %s: %.3g -> %.3g  '%s%s%s'\n",
+            change.regressed ? kColorFail : kColorSuccess,
+            change.regressed ? "regressed" : "faster", kColorNormal,
+            change.pct, change.metric.c_str(), change.base, change.value,
+            kColorTag, change.key.c_str(), kColorNormal);
+    }
+    if (cnt < mChanges.size())
+        printf("  (%zu more not shown)\n", mChanges.size() - cnt);
+}
+#endif
+}
+#endif
@@ -0,0 +1,254 @@
+/** @file Hardware performance counters (cycles, instructions, cache and branch misses),
+ *  read via the Linux perf_event_open() interface
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_PERFCOUNTERS_H
+#define ASYNCTEST_PERFCOUNTERS_H
+
+#include <string>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+    #include <sys/syscall.h>
+    #include <linux/perf_event.h>
+#endif
+
+namespace test
+{
+/** A group of hardware counters of the calling thread. Only user space events are counted,
+ * which is allowed for the thread's own counters with the default perf_event_paranoid
+ * setting. The counters are opened once per thread, on first use, and are never stopped -
+ * a measurement is the difference between two reads. If the kernel or the (virtual) machine
+ * doesn't provide some of the counters, they are reported as unavailable, and if none can be
+ * opened, isOpen() returns false and the reads return invalid values
+ */
+class PerfCounters
+{
+public:
+    enum Counter { kCycles = 0, kInstructions, kCacheMisses, kBranchMisses, kNumCounters };
+    static const char* name(int counter)
+    {
+        static const char* names[kNumCounters] = {
+            "cycles", "instructions", "cache_misses", "branch_misses"
+        };
+        return (counter >= 0 && counter < kNumCounters) ? names[counter] : "?";
+    }
+/** Returns the counter with the specified name, or -1 */
+    static int fromName(const std::string& str)
+    {
+        for (int i = 0; i < kNumCounters; i++)
+        {
+            if (str == name(i))
+                return i;
+        }
+        return -1;
+    }
+    struct Values
+    {
+        double v[kNumCounters] = {0};
+        unsigned mask = 0; //which counters are valid, as bits (1 << Counter)
+        bool valid() const { return mask != 0; }
+        bool has(int counter) const { return (mask & (1 << counter)) != 0; }
+        double operator[](int counter) const { return v[counter]; }
+        double ipc() const
+        {
+            return (has(kCycles) && has(kInstructions) && v[kCycles])
+                ? v[kInstructions] / v[kCycles] : 0;
+        }
+        Values operator/(double div) const
+        {
+            Values result(*this);
+            for (int i = 0; i < kNumCounters; i++)
+                result.v[i] = div ? v[i] / div : 0;
+            return result;
+        }
+        Values operator-(const Values& other) const
+        {
+            Values result;
+            result.mask = mask & other.mask;
+            for (int i = 0; i < kNumCounters; i++)
+                result.v[i] = v[i] - other.v[i];
+            return result;
+        }
+    /** Accumulates the values of another measurement, i.e. of another thread */
+        void add(const Values& other)
+        {
+            if (!other.valid())
+                return;
+            mask = valid() ? (mask & other.mask) : other.mask;
+            for (int i = 0; i < kNumCounters; i++)
+                v[i] += other.v[i];
+        }
+        std::string toString() const
+        {
+            char buf[32];
+            std::string result = std::to_string(mask);
+            for (int i = 0; i < kNumCounters; i++)
+            {
+                snprintf(buf, sizeof(buf), " %.17g", v[i]);
+                result += buf;
+            }
+            return result;
+        }
+        static Values fromString(const std::string& str)
+        {
+            Values result;
+            const char* pos = str.c_str();
+            char* end;
+            result.mask = strtoul(pos, &end, 10);
+            for (int i = 0; i < kNumCounters; i++)
+            {
+                pos = end;
+                result.v[i] = strtod(pos, &end);
+            }
+            return result;
+        }
+    /** A human-readable representation of the values, for the test log */
+        std::string format() const
+        {
+            std::string result;
+            char buf[64];
+            for (int i = 0; i < kNumCounters; i++)
+            {
+                if (!has(i))
+                    continue;
+                if (!result.empty())
+                    result += ", ";
+                result += formatCount(v[i]);
+                result.append(" ").append(name(i));
+                if (i == kInstructions && ipc())
+                {
+                    snprintf(buf, sizeof(buf), " (IPC %.2f)", ipc());
+                    result += buf;
+                }
+            }
+            return result;
+        }
+    };
+    static std::string formatCount(double val)
+    {
+        char buf[32];
+        if (val >= 1e9)
+            snprintf(buf, sizeof(buf), "%.2fG", val / 1e9);
+        else if (val >= 1e6)
+            snprintf(buf, sizeof(buf), "%.2fM", val / 1e6);
+        else if (val >= 1e4)
+            snprintf(buf, sizeof(buf), "%.1fK", val / 1e3);
+        else
+            snprintf(buf, sizeof(buf), "%.4g", val);
+        return buf;
+    }
+protected:
+    int mLeaderFd = -1;
+    int mFds[kNumCounters];
+    int mOrder[kNumCounters]; //the counters in the order they were added to the group
+    int mNumOpen = 0;
+    std::string mError;
+#ifdef __linux__
+    static int openCounter(int counter, int groupFd)
+    {
+        static const uint64_t configs[kNumCounters] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+        };
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[counter];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                         | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return (int)syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+    }
+#endif
+    pid_t mPid = 0; //the counters of a forked child have to be reopened
+    void open()
+    {
+        mPid = getpid();
+        mNumOpen = 0;
+        for (int i = 0; i < kNumCounters; i++)
+            mFds[i] = -1;
+#ifdef __linux__
+        for (int i = 0; i < kNumCounters; i++)
+        {
+            int fd = openCounter(i, mLeaderFd);
+            if (fd < 0)
+            {
+                if (mError.empty())
+                    mError = std::string("perf_event_open(") + name(i) + "): " + strerror(errno);
+                continue;
+            }
+            if (mLeaderFd < 0)
+                mLeaderFd = fd;
+            mFds[i] = fd;
+            mOrder[mNumOpen++] = i;
+        }
+        if (mLeaderFd >= 0)
+            mError.clear(); //some counters may be missing, but we can measure
+#else
+        mError = "Hardware performance counters are supported only on Linux";
+#endif
+    }
+    void close()
+    {
+        for (int i = 0; i < kNumCounters; i++)
+        {
+            if (mFds[i] >= 0)
+                ::close(mFds[i]);
+            mFds[i] = -1;
+        }
+        mLeaderFd = -1;
+        mNumOpen = 0;
+        mError.clear();
+    }
+    PerfCounters() { open(); }
+public:
+    ~PerfCounters() { close(); }
+/** Returns the counters of the calling thread, opening them on first use. The counters
+ * inherited from the parent of a forked process count the parent's thread, so they
+ * are reopened in the child */
+    static PerfCounters& forThread()
+    {
+        static thread_local PerfCounters sInstance;
+        if (sInstance.mPid != getpid())
+        {
+            sInstance.close();
+            sInstance.open();
+        }
+        return sInstance;
+    }
+    bool isOpen() const { return mLeaderFd >= 0; }
+/** The reason why the counters could not be opened */
+    const std::string& error() const { return mError; }
+/** Reads the current values of the counters. If the counters were multiplexed with other
+ * events, the values are extrapolated to the whole time they were enabled */
+    Values read() const
+    {
+        Values result;
+#ifdef __linux__
+        if (mLeaderFd < 0)
+            return result;
+        uint64_t buf[3 + kNumCounters];
+        auto len = ::read(mLeaderFd, buf, sizeof(buf));
+        if (len < (ssize_t)(3 * sizeof(uint64_t)) || buf[0] != (uint64_t)mNumOpen)
+            return result;
+        double scale = (buf[2] && buf[2] < buf[1]) ? (double)buf[1] / buf[2] : 1.0;
+        for (int i = 0; i < mNumOpen; i++)
+        {
+            int counter = mOrder[i];
+            result.v[counter] = buf[3 + i] * scale;
+            result.mask |= 1 << counter;
+        }
+#endif
+        return result;
+    }
+};
+}
+#endif
@@ -0,0 +1,525 @@
+/** @file Property-based testing: checks an invariant against many randomly generated
+ *  inputs, and reduces a failing input to a minimal one
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_PROPERTY_H
+#define ASYNCTEST_PROPERTY_H
+
+#include "asyncTest.hpp"
+#include <tuple>
+#include <sstream>
+#include <limits>
+#include <thread>
+#include <atomic>
+
+namespace test
+{
+/** Fast random generator of the property engine (splitmix64). Each case has its own
+ * generator, seeded from the test seed and the case index, so that the generated inputs
+ * don't depend on how the cases are distributed among threads */
+class PropRandom
+{
+protected:
+    uint64_t mState;
+public:
+    PropRandom(uint64_t seed): mState(seed) {}
+    uint64_t next()
+    {
+        uint64_t z = (mState += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+/** Returns a number in the range [0, n), or 0 if n is 0 */
+    uint64_t below(uint64_t n) { return n ? next() % n : 0; }
+/** Returns true with a probability of 1/n */
+    bool oneIn(unsigned n) { return below(n) == 0; }
+};
+
+/** Settings of a property check */
+struct PropertyConfig
+{
+/** Number of random cases. If zero, --prop-cases is used, or kDefaultCases */
+    size_t numCases = 0;
+/** The max "size" of the generated values, i.e. the max length of strings and containers.
+ * The size grows from 1 to this value over the cases, so that simple inputs are tried first */
+    size_t maxSize = 100;
+/** Number of threads that run the cases. The predicate must be thread-safe if this is more than 1 */
+    unsigned numThreads = 1;
+/** The cases are distributed among the threads in batches of this size */
+    size_t batchSize = 64;
+/** Max number of successful shrink steps */
+    size_t maxShrinks = 1000;
+    enum { kDefaultCases = 1000 };
+    PropertyConfig& cases(size_t n) { numCases = n; return *this; }
+    PropertyConfig& size(size_t n) { maxSize = n; return *this; }
+    PropertyConfig& threads(unsigned n) { numThreads = n ? n : Options::numCpus(); return *this; }
+    PropertyConfig& batch(size_t n) { batchSize = n ? n : 1; return *this; }
+    PropertyConfig& shrinks(size_t n) { maxShrinks = n; return *this; }
+};
+
+/** Human-readable representation of a generated value, for the failure report. Can be
+ * specialized for user types */
+template <class T>
+struct PropPrinter: public ValuePrinter<T> {};
+
+/** Built-in generators. A generator is an object with:
+ * - a \c value_type typedef
+ * - <tt>value_type operator()(PropRandom& rnd, size_t size) const</tt>, which generates a value
+ * - <tt>std::vector<value_type> shrink(const value_type& val) const</tt>, which returns
+ *   simpler variants of a value, the simplest first
+ */
+namespace gen
+{
+template <class T>
+struct Integer
+{
+    typedef T value_type;
+    T min;
+    T max;
+    T operator()(PropRandom& rnd, size_t size) const
+    {
+        if (rnd.oneIn(8)) //edge values
+        {
+            switch (rnd.below(3))
+            {
+                case 0: return min;
+                case 1: return max;
+                default: return target();
+            }
+        }
+        //small values are more likely in the early cases
+        uint64_t range = (uint64_t)max - (uint64_t)min;
+        uint64_t limit = (uint64_t)size * size * 16;
+        if (range > limit && rnd.oneIn(2))
+        {
+            T base = target();
+            T offs = (T)rnd.below(limit + 1);
+            T val = (rnd.oneIn(2) && base >= (T)(min + offs)) ? (T)(base - offs) : (T)(base + offs);
+            return (val < min || val > max) ? base : val;
+        }
+        return (range == std::numeric_limits<uint64_t>::max())
+            ? (T)rnd.next() : (T)((uint64_t)min + rnd.below(range + 1));
+    }
+/** The value that is shrunk towards - zero, or the bound of the range that is closest to it */
+    T target() const { return (min > 0) ? min : ((max < 0) ? max : 0); }
+    std::vector<T> shrink(const T& val) const
+    {
+        std::vector<T> result;
+        T tgt = target();
+        if (val == tgt)
+            return result;
+        result.push_back(tgt);
+        //approach the target by halving the distance, down to 1
+        uint64_t dist = (val > tgt) ? (uint64_t)val - (uint64_t)tgt : (uint64_t)tgt - (uint64_t)val;
+        for (uint64_t step = dist / 2; step > 0; step /= 2)
+            result.push_back((T)((val > tgt) ? (uint64_t)val - step : (uint64_t)val + step));
+        return result;
+    }
+};
+template <class T>
+Integer<T> integer(T min=std::numeric_limits<T>::min(), T max=std::numeric_limits<T>::max())
+{
+    return Integer<T>{min, max};
+}
+
+template <class T>
+struct Real
+{
+    typedef T value_type;
+    T min;
+    T max;
+    T operator()(PropRandom& rnd, size_t) const
+    {
+        if (rnd.oneIn(8))
+            return rnd.oneIn(2) ? min : max;
+        return min + (max - min) * ((rnd.next() >> 11) * (1.0 / 9007199254740992.0));
+    }
+    std::vector<T> shrink(const T& val) const
+    {
+        std::vector<T> result;
+        T tgt = (min > 0) ? min : ((max < 0) ? max : 0);
+        if (val != tgt)
+        {
+            result.push_back(tgt);
+            T rounded = (T)(long long)val;
+            if (rounded != val && rounded >= min && rounded <= max)
+                result.push_back(rounded);
+        }
+        return result;
+    }
+};
+template <class T=double>
+Real<T> real(T min=-1e6, T max=1e6) { return Real<T>{min, max}; }
+
+struct String
+{
+    typedef std::string value_type;
+    size_t maxLen;
+    std::string alphabet;
+    std::string operator()(PropRandom& rnd, size_t size) const
+    {
+        size_t len = rnd.below(std::min(size, maxLen) + 1);
+        std::string result(len, ' ');
+        for (auto& ch: result)
+            ch = alphabet.empty() ? (char)(1 + rnd.below(255)) : alphabet[rnd.below(alphabet.size())];
+        return result;
+    }
+    std::vector<std::string> shrink(const std::string& val) const
+    {
+        std::vector<std::string> result;
+        if (val.empty())
+            return result;
+        result.push_back(std::string());
+        for (size_t chunk = val.size() / 2; chunk > 0; chunk /= 2) //remove chunks
+        {
+            for (size_t pos = 0; pos + chunk <= val.size(); pos += chunk)
+                result.push_back(std::string(val).erase(pos, chunk));
+        }
+        char simplest = alphabet.empty() ? 'a' : alphabet[0];
+        for (size_t i = 0; i < val.size(); i++) //simplify characters
+        {
+            if (val[i] == simplest)
+                continue;
+            std::string str(val);
+            str[i] = simplest;
+            result.push_back(str);
+        }
+        return result;
+    }
+};
+/** Strings of up to \c maxLen characters from \c alphabet. An empty alphabet means any
+ * non-zero character */
+inline String string(size_t maxLen=std::numeric_limits<size_t>::max(),
+    const std::string& alphabet="abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ")
+{
+    return String{maxLen, alphabet};
+}
+
+template <class G>
+struct VectorOf
+{
+    typedef std::vector<typename G::value_type> value_type;
+    G elem;
+    size_t maxLen;
+    value_type operator()(PropRandom& rnd, size_t size) const
+    {
+        size_t len = rnd.below(std::min(size, maxLen) + 1);
+        value_type result;
+        result.reserve(len);
+        for (size_t i = 0; i < len; i++)
+            result.push_back(elem(rnd, size));
+        return result;
+    }
+    std::vector<value_type> shrink(const value_type& val) const
+    {
+        std::vector<value_type> result;
+        if (val.empty())
+            return result;
+        result.push_back(value_type());
+        for (size_t chunk = val.size() / 2; chunk > 0; chunk /= 2) //remove chunks
+        {
+            for (size_t pos = 0; pos + chunk <= val.size(); pos += chunk)
+            {
+                value_type vec(val);
+                vec.erase(vec.begin() + pos, vec.begin() + pos + chunk);
+                result.push_back(std::move(vec));
+            }
+        }
+        for (size_t i = 0; i < val.size(); i++) //shrink the elements
+        {
+            for (auto& item: elem.shrink(val[i]))
+            {
+                value_type vec(val);
+                vec[i] = item;
+                result.push_back(std::move(vec));
+            }
+        }
+        return result;
+    }
+};
+template <class G>
+VectorOf<G> vectorOf(G elem, size_t maxLen=std::numeric_limits<size_t>::max())
+{
+    return VectorOf<G>{elem, maxLen};
+}
+
+/** Picks one of the specified values. Shrinks towards the first ones */
+template <class T>
+struct Element
+{
+    typedef T value_type;
+    std::vector<T> items;
+    T operator()(PropRandom& rnd, size_t) const { return items[rnd.below(items.size())]; }
+    std::vector<T> shrink(const T& val) const
+    {
+        std::vector<T> result;
+        for (auto& item: items)
+        {
+            if (item == val)
+                break;
+            result.push_back(item);
+        }
+        return result;
+    }
+};
+template <class T>
+Element<T> element(std::initializer_list<T> items) { return Element<T>{items}; }
+
+/** Generator of user types. \c genFunc is called as <tt>T genFunc(PropRandom& rnd, size_t size)</tt>,
+ * and \c shrinkFunc, if provided, as <tt>std::vector<T> shrinkFunc(const T& val)</tt> */
+template <class T>
+struct Custom
+{
+    typedef T value_type;
+    std::function<T(PropRandom&, size_t)> genFunc;
+    std::function<std::vector<T>(const T&)> shrinkFunc;
+    T operator()(PropRandom& rnd, size_t size) const { return genFunc(rnd, size); }
+    std::vector<T> shrink(const T& val) const
+    {
+        return shrinkFunc ? shrinkFunc(val) : std::vector<T>();
+    }
+};
+template <class T>
+Custom<T> custom(std::function<T(PropRandom&, size_t)> genFunc,
+    std::function<std::vector<T>(const T&)> shrinkFunc=nullptr)
+{
+    return Custom<T>{genFunc, shrinkFunc};
+}
+}
+
+namespace detail
+{
+template <size_t...> struct IndexSeq {};
+template <size_t N, size_t... Is>
+struct MakeIndexSeq: MakeIndexSeq<N-1, N-1, Is...> {};
+template <size_t... Is>
+struct MakeIndexSeq<0, Is...> { typedef IndexSeq<Is...> type; };
+
+/** Calls the predicate and converts a false return value to an error */
+template <class P, class... Args>
+typename std::enable_if<std::is_same<decltype(std::declval<P&>()(std::declval<const Args&>()...)), bool>::value>::type
+callPredicate(P& pred, const Args&... args)
+{
+    if (!pred(args...))
+        throw BailoutException("Property returned false");
+}
+template <class P, class... Args>
+typename std::enable_if<!std::is_same<decltype(std::declval<P&>()(std::declval<const Args&>()...)), bool>::value>::type
+callPredicate(P& pred, const Args&... args)
+{
+    pred(args...);
+}
+
+/** Runs the cases of one property and shrinks the first failure found */
+template <class P, class... Gens>
+class PropertyRunner
+{
+protected:
+    typedef std::tuple<typename Gens::value_type...> Values;
+    typedef typename MakeIndexSeq<sizeof...(Gens)>::type Indexes;
+    const PropertyConfig& mConfig;
+    std::tuple<Gens...> mGens;
+    P& mPred;
+    uint64_t mSeed;
+    template <size_t... Is>
+    Values generate(PropRandom& rnd, size_t size, IndexSeq<Is...>) const
+    {
+        return Values{std::get<Is>(mGens)(rnd, size)...};
+    }
+    template <size_t... Is>
+    void call(const Values& values, IndexSeq<Is...>)
+    {
+        callPredicate(mPred, std::get<Is>(values)...);
+    }
+    template <size_t... Is>
+    void print(std::ostream& os, const Values& values, IndexSeq<Is...>) const
+    {
+        int dummy[] = {0, (os << "\n* * *   arg" << Is << " = ",
+            PropPrinter<typename std::tuple_element<Is, Values>::type>::print(os, std::get<Is>(values)), 0)...};
+        (void)dummy;
+    }
+/** Tries the simpler variants of argument \c I. Returns true if one of them fails, which
+ * then replaces the current value */
+    template <size_t I>
+    bool shrinkArg(Values& values, std::string& msg)
+    {
+        for (auto& candidate: std::get<I>(mGens).shrink(std::get<I>(values)))
+        {
+            Values attempt(values);
+            std::get<I>(attempt) = candidate;
+            auto err = evaluate(attempt);
+            if (!err.empty())
+            {
+                values = std::move(attempt);
+                msg = std::move(err);
+                return true;
+            }
+        }
+        return false;
+    }
+    template <size_t... Is>
+    bool shrinkStep(Values& values, std::string& msg, IndexSeq<Is...>)
+    {
+        bool shrunk = false;
+        int dummy[] = {0, (shrunk = shrunk || shrinkArg<Is>(values, msg), 0)...};
+        (void)dummy;
+        return shrunk;
+    }
+public:
+    PropertyRunner(const PropertyConfig& config, uint64_t seed, P& pred, const Gens&... gens)
+    : mConfig(config), mGens(gens...), mPred(pred), mSeed(seed) {}
+    size_t sizeOfCase(size_t idx, size_t numCases) const
+    {
+        return 1 + (mConfig.maxSize ? (idx * mConfig.maxSize / (numCases ? numCases : 1)) : 0);
+    }
+    Values generateCase(size_t idx, size_t numCases) const
+    {
+        PropRandom rnd(mSeed ^ (idx * 0xD1B54A32D192ED03ULL));
+        return generate(rnd, sizeOfCase(idx, numCases), Indexes());
+    }
+/** Runs the predicate with the specified values.
+ * @returns The error message, or an empty string if the property holds */
+    std::string evaluate(const Values& values)
+    {
+        std::string msg;
+        auto& capture = Test::errorCapture();
+        auto prevCapture = capture;
+        capture = &msg; //check() reports to us instead of failing the test
+        try
+        {
+            call(values, Indexes());
+        }
+        catch(BailoutException& e)
+        {
+            if (msg.empty())
+                msg = e.what();
+        }
+        catch(std::exception& e)
+        {
+            msg = std::string("Exception: ") + e.what();
+        }
+        catch(...)
+        {
+            msg = "Non-standard exception";
+        }
+        capture = prevCapture;
+        return msg;
+    }
+/** Reduces the failing values while they still fail. Returns the number of shrink steps */
+    size_t shrink(Values& values, std::string& msg)
+    {
+        size_t steps = 0;
+        while (steps < mConfig.maxShrinks && shrinkStep(values, msg, Indexes()))
+            steps++;
+        return steps;
+    }
+    std::string describe(const Values& values) const
+    {
+        std::ostringstream os;
+        print(os, values, Indexes());
+        return os.str();
+    }
+};
+}
+
+/** Checks that \c pred holds for randomly generated inputs. The last argument is the
+ * predicate, and the preceding ones are the generators of its arguments. The predicate
+ * can return bool, or can use check() and throw exceptions. If it fails, the failing input is
+ * shrunk to a minimal one, which is reported as a failure of the test, together with the
+ * --seed option that reproduces it. Example:
+ * \code
+ * test::property(test, "reverse twice", test::gen::vectorOf(test::gen::integer<int>()),
+ *     [](const std::vector<int>& vec) { return reversed(reversed(vec)) == vec; });
+ * \endcode
+ */
+template <class... Args>
+void property(Test& test, const PropertyConfig& config, const std::string& name, Args&&... args);
+
+namespace detail
+{
+template <class P, class... Gens>
+void runProperty(Test& test, const PropertyConfig& config, const std::string& name,
+    P& pred, const Gens&... gens)
+{
+    size_t numCases = config.numCases ? config.numCases
+        : (gOptions.propertyCases ? gOptions.propertyCases : (size_t)PropertyConfig::kDefaultCases);
+    uint64_t seed = ((uint64_t)test.seed << 32) ^ std::hash<std::string>()(name);
+    PropertyRunner<P, Gens...> runner(config, seed, pred, gens...);
+    size_t batchSize = config.batchSize ? config.batchSize : 1;
+    size_t numBatches = (numCases + batchSize - 1) / batchSize;
+    std::atomic<size_t> nextBatch(0);
+    std::atomic<size_t> failedCase(SIZE_MAX);
+    auto worker = [&]()
+    {
+        for (;;)
+        {
+            size_t batch = nextBatch.fetch_add(1);
+            if (batch >= numBatches || failedCase.load() != SIZE_MAX)
+                return;
+            size_t end = std::min(numCases, (batch + 1) * batchSize);
+            for (size_t i = batch * batchSize; i < end; i++)
+            {
+                if (runner.evaluate(runner.generateCase(i, numCases)).empty())
+                    continue;
+                size_t prev = failedCase.load();
+                while (i < prev && !failedCase.compare_exchange_weak(prev, i));
+                return;
+            }
+        }
+    };
+    unsigned numThreads = std::max(1u, std::min<unsigned>(config.numThreads, numBatches));
+    if (numThreads == 1)
+    {
+        worker();
+    }
+    else
+    {
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < numThreads; i++)
+            threads.emplace_back(worker);
+        for (auto& thread: threads)
+            thread.join();
+    }
+    if (failedCase == SIZE_MAX)
+    {
+        TEST_LOG("  property '%s': %zu cases passed", name.c_str(), numCases);
+        return;
+    }
+    auto values = runner.generateCase(failedCase, numCases);
+    auto original = runner.describe(values);
+    auto msg = runner.evaluate(values);
+    size_t steps = runner.shrink(values, msg);
+    std::string report = "Property '" + name + "' failed at case " + std::to_string(failedCase)
+        + " of " + std::to_string(numCases) + ", with input:" + original;
+    if (steps)
+        report += "\n* * * Shrunk in " + std::to_string(steps) + " step(s) to:" + runner.describe(values);
+    report += "\n* * * " + msg;
+    report += "\n* * * Reproduce with: --filter='" + test.fullName() + "' --seed=" + std::to_string(test.seed);
+    test.error(report);
+    throw BailoutException(report);
+}
+template <class Tuple, size_t... Is>
+void propertyFromTuple(Test& test, const PropertyConfig& config, const std::string& name,
+    Tuple& args, IndexSeq<Is...>)
+{
+    runProperty(test, config, name, std::get<sizeof...(Is)>(args), std::get<Is>(args)...);
+}
+}
+
+template <class... Args>
+void property(Test& test, const PropertyConfig& config, const std::string& name, Args&&... args)
+{
+    static_assert(sizeof...(Args) >= 2, "property() needs at least one generator and a predicate");
+    std::tuple<typename std::decay<Args>::type...> tuple(std::forward<Args>(args)...);
+    detail::propertyFromTuple(test, config, name, tuple,
+        typename detail::MakeIndexSeq<sizeof...(Args) - 1>::type());
+}
+template <class... Args>
+void property(Test& test, const std::string& name, Args&&... args)
+{
+    property(test, PropertyConfig(), name, std::forward<Args>(args)...);
+}
+}
+#endif
@@ -0,0 +1,155 @@
+/** @file Selection and ordering of the tests to run, based on their recorded execution times
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_SCHEDULER_H
+#define ASYNCTEST_SCHEDULER_H
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include "options.hpp"
+#include "perfBaseline.hpp"
+#include "asyncTestConfig.hpp"
+
+namespace test
+{
+/** Decides which tests run in the current shard and in what order. It keeps a history
+ * of the execution times of the tests in a small database file, and uses it to:
+ * - order the tests longest-first when they are run in parallel, so that a long test
+ *   doesn't start last and dominate the total time
+ * - distribute the tests among the shards so that the shards have approximately the same
+ *   total duration (greedy longest-processing-time-first assignment).
+ * All shard processes run the same group bodies in the same order, so they compute the
+ * same assignment independently, provided they see the same history. Therefore, a sharded
+ * run never writes the history file it reads - a shard that starts after another one has
+ * finished would see different durations, and run a different set of tests. The updated
+ * history of a sharded run can be written to a separate file, via --durations-out
+ */
+class TestScheduler
+{
+public:
+/** Max weight of the recorded history when folding in the times of the current run */
+    enum { kMaxHistoryCount = 5 };
+/** Assumed duration of a test when there is no history at all */
+    enum { kDefaultEstimateMs = 100 };
+protected:
+    const Options& mOptions;
+    MetricStore mHistory;
+    MetricStore mCurrent;
+    bool mLoaded = false;
+    double mDefaultEstimate = kDefaultEstimateMs;
+/** The accumulated estimated load of each shard. It is carried over from group to group */
+    std::vector<double> mShardLoads;
+    void load();
+public:
+    TestScheduler(const Options& opts): mOptions(opts) {}
+    bool isSharded() const { return mOptions.shardCount > 1; }
+/** Returns the expected duration of a test in milliseconds */
+    double estimate(const std::string& key)
+    {
+        if (!mLoaded)
+            load();
+        auto stat = mHistory.find(key, "time_ms");
+        return stat ? stat->mean : mDefaultEstimate;
+    }
+/** Whether plan() can select or order the tests other than all of them in registration order.
+ * If not, it doesn't need to be called */
+    bool reorders(bool lptOrder) const
+    {
+        return isSharded() || (lptOrder && !mOptions.durationsFile.empty());
+    }
+/** Selects the tests that should run in the current shard and the order in which to run them.
+ * The keys of the tests are requested one at a time, and only if there is a history to look
+ * them up in, so that planning a large parameter sweep doesn't hold all of its names at once
+ * @param count The number of tests
+ * @param keyOf Returns the key of the test with the specified index, in registration order
+ * @param lptOrder Whether to order the selected tests longest-first. Otherwise they are
+ * returned in registration order
+ * @returns The indexes of the selected tests
+ */
+    std::vector<size_t> plan(size_t count, const std::function<std::string(size_t)>& keyOf, bool lptOrder);
+/** The file to which the updated history is written. Empty if it's not written */
+    const std::string& outputFile() const
+    {
+        static const std::string none;
+        auto& out = mOptions.durationsOutFile.empty() ? mOptions.durationsFile : mOptions.durationsOutFile;
+        return (isSharded() && out == mOptions.durationsFile) ? none : out;
+    }
+/** Records the execution time of a test in the current run */
+    void record(const std::string& key, double ms)
+    {
+        if (!outputFile().empty())
+            mCurrent.add(key, "time_ms", ms);
+    }
+/** Folds the execution times of the current run into the history, and writes it to the
+ * output file. If that file doesn't exist yet, the history read at startup is its base */
+    void save()
+    {
+        if (outputFile().empty() || mCurrent.empty())
+            return;
+        if (!mLoaded)
+            load();
+        MetricStore::update(outputFile(), mCurrent, kMaxHistoryCount, &mHistory);
+    }
+};
+
+#ifdef ASYNCTEST_COMPILE_IMPL
+ASYNCTEST_INLINE void TestScheduler::load()
+{
+    mLoaded = true;
+    mShardLoads.assign(mOptions.shardCount, 0.0);
+    if (mOptions.durationsFile.empty() || !mHistory.load(mOptions.durationsFile))
+        return;
+    //tests without history are assumed to take as much as the average known test
+    double sum = 0;
+    size_t cnt = 0;
+    for (auto& item: mHistory.items)
+    {
+        if (item.first.second != "time_ms")
+            continue;
+        sum += item.second.mean;
+        cnt++;
+    }
+    if (cnt)
+        mDefaultEstimate = std::max(sum / cnt, 1.0);
+}
+
+ASYNCTEST_INLINE std::vector<size_t> TestScheduler::plan(size_t count,
+    const std::function<std::string(size_t)>& keyOf, bool lptOrder)
+{
+    if (!mLoaded)
+        load();
+    std::vector<double> est(count, mDefaultEstimate);
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!mHistory.empty())
+            est[i] = estimate(keyOf(i));
+        order[i] = i;
+    }
+    if (lptOrder || isSharded())
+    {
+        std::stable_sort(order.begin(), order.end(),
+            [&est](size_t a, size_t b) { return est[a] > est[b]; });
+    }
+    if (isSharded())
+    {
+        std::vector<size_t> selected;
+        for (auto idx: order)
+        {
+            auto shard = std::min_element(mShardLoads.begin(), mShardLoads.end()) - mShardLoads.begin();
+            mShardLoads[shard] += est[idx];
+            if ((unsigned)shard == mOptions.shardIndex)
+                selected.push_back(idx);
+        }
+        order.swap(selected);
+    }
+    if (!lptOrder)
+        std::sort(order.begin(), order.end());
+    return order;
+}
+#endif
+}
+#endif
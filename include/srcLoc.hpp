@@ -0,0 +1,64 @@
+/** @file Compact source locations, that are captured automatically at the call sites of the
+ *  event loop functions, i.e. schedCall() and done()
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_SRCLOC_H
+#define ASYNCTEST_SRCLOC_H
+
+#include <string>
+#include <string.h>
+#if defined(__has_include)
+    #if __has_include(<source_location>) && (__cplusplus >= 202002L)
+        #include <source_location>
+        #ifdef __cpp_lib_source_location
+            #define ASYNCTEST_HAVE_STD_SOURCE_LOCATION
+        #endif
+    #endif
+#endif
+
+namespace test
+{
+/** A file and line. The file name is not copied - it is the static string of the compiler */
+struct SrcLoc
+{
+    const char* file;
+    int line;
+    SrcLoc(): file(nullptr), line(0) {}
+    SrcLoc(const char* aFile, int aLine): file(aFile), line(aLine) {}
+    bool isKnown() const { return file != nullptr; }
+/** The file name, without the directory */
+    const char* fileName() const
+    {
+        if (!file)
+            return "";
+        const char* base = strrchr(file, '/');
+        return base ? base + 1 : file;
+    }
+/** "<file name>:<line>", or an empty string if the location is not known */
+    std::string toString() const
+    {
+        return file ? std::string(fileName()).append(":").append(std::to_string(line)) : std::string();
+    }
+};
+}
+
+/** The source location of the caller, when used as a default argument of a function, i.e.
+ * \c void func(test::SrcLoc loc=ASYNCTEST_CALLER_LOC). Uses std::source_location with C++20,
+ * the equivalent builtins of GCC and Clang otherwise. If none is available, the location is
+ * not known */
+#if defined(ASYNCTEST_HAVE_STD_SOURCE_LOCATION)
+    #define ASYNCTEST_CALLER_LOC test::SrcLoc(std::source_location::current().file_name(), \
+        (int)std::source_location::current().line())
+#elif defined(__has_builtin)
+    #if __has_builtin(__builtin_FILE) && __has_builtin(__builtin_LINE)
+        #define ASYNCTEST_CALLER_LOC test::SrcLoc(__builtin_FILE(), __builtin_LINE())
+    #endif
+#elif defined(__GNUC__)
+    #define ASYNCTEST_CALLER_LOC test::SrcLoc(__builtin_FILE(), __builtin_LINE())
+#endif
+#ifndef ASYNCTEST_CALLER_LOC
+    #define ASYNCTEST_CALLER_LOC test::SrcLoc()
+#endif
+
+#endif
@@ -0,0 +1,176 @@
+/** @file Breakdown of the time of the test run - where it goes, and what limits it
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_TIMEREPORT_H
+#define ASYNCTEST_TIMEREPORT_H
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include "options.hpp"
+#include "asyncTestConfig.hpp"
+
+namespace test
+{
+/** Collects the time breakdown of each test and group, and prints a report at the end of
+ * the run (--time-report[=N]). The time of a test is split into its setup (before-each),
+ * the body - busy executing code, or idle, i.e. sleeping in the event loop while waiting
+ * for the next scheduled call - and its teardown (cleanup and after-each). The report ranks
+ * the tests by wall time and by idle ratio, and shows the critical path of the run: the
+ * part of it that can't be shortened by running the tests of each group in parallel.
+ * The times of the tests run in worker processes are passed to the main process with the
+ * rest of the result, so the report is always collected in the main process
+ */
+class TimeReport
+{
+public:
+    typedef long long Ts;
+/** Tests shorter than this are not ranked by idle ratio, as the ratio is mostly noise */
+    enum { kMinIdleRankMs = 10 };
+    struct TestTimes
+    {
+        std::string name;
+        Ts setup = 0;
+        Ts body = 0;
+/** The part of the body spent idle. For sync tests, it's estimated from the CPU time */
+        Ts idle = 0;
+        Ts teardown = 0;
+        Ts wall() const { return setup + body + teardown; }
+        double idleRatio() const { return body ? (double)idle / body : 0; }
+    };
+    struct GroupTimes
+    {
+        std::string name;
+        Ts setup = 0;
+        Ts cleanup = 0;
+        Ts wall = 0;
+        std::vector<TestTimes> tests;
+/** The longest test, or nullptr if the group has no tests */
+        const TestTimes* longest() const
+        {
+            const TestTimes* result = nullptr;
+            for (auto& test: tests)
+            {
+                if (!result || test.wall() > result->wall())
+                    result = &test;
+            }
+            return result;
+        }
+/** The wall time of the group if all its tests were run in parallel */
+        Ts criticalPath() const
+        {
+            auto test = longest();
+            return setup + cleanup + (test ? test->wall() : 0);
+        }
+    };
+protected:
+    const Options& mOptions;
+    std::vector<GroupTimes> mGroups;
+    std::vector<TestTimes> mPendingTests;
+    bool mPrinted = false;
+    static double percent(Ts part, Ts total) { return total ? part * 100.0 / total : 0; }
+public:
+    TimeReport(const Options& opts): mOptions(opts) {}
+    bool isEnabled() const { return mOptions.timeReport > 0; }
+/** Records the times of a test of the group that is currently running */
+    void addTest(TestTimes&& times)
+    {
+        mPendingTests.push_back(std::move(times));
+    }
+/** Records the times of a group, together with the tests added since the previous group */
+    void addGroup(GroupTimes&& times)
+    {
+        times.tests.swap(mPendingTests);
+        mPendingTests.clear();
+        mGroups.push_back(std::move(times));
+    }
+/** Prints the report, if enabled. Printed only once, even if called again */
+    void print();
+};
+
+#ifdef ASYNCTEST_COMPILE_IMPL
+ASYNCTEST_INLINE void TimeReport::print()
+{
+    if (!isEnabled() || mPrinted || mGroups.empty())
+        return;
+    mPrinted = true;
+    std::vector<const TestTimes*> tests;
+    Ts suiteWall = 0, groupSetup = 0, testSetup = 0, busy = 0, idle = 0, critical = 0;
+    for (auto& group: mGroups)
+    {
+        suiteWall += group.wall;
+        groupSetup += group.setup + group.cleanup;
+        critical += group.criticalPath();
+        for (auto& test: group.tests)
+        {
+            tests.push_back(&test);
+            testSetup += test.setup + test.teardown;
+            busy += test.body - test.idle;
+            idle += test.idle;
+        }
+    }
+    size_t maxShown = mOptions.timeReport;
+    auto total = groupSetup + testSetup + busy + idle;
+    printf("Time report: %zu tests in %zu groups, %lld ms wall\n", tests.size(), mGroups.size(), suiteWall);
+    printf("  Time by category (summed over the tests, %lld ms):\n", total);
+    auto printCategory = [total](const char* name, Ts ms)
+    {
+        printf("    %-26s %8lld ms %5.1f%%\n", name, ms, percent(ms, total));
+    };
+    printCategory("group setup and cleanup:", groupSetup);
+    printCategory("test setup and teardown:", testSetup);
+    printCategory("test bodies, busy:", busy);
+    printCategory("test bodies, idle:", idle);
+
+    std::stable_sort(tests.begin(), tests.end(), [](const TestTimes* a, const TestTimes* b)
+    {
+        return a->wall() > b->wall();
+    });
+    printf("  Slowest tests:\n");
+    printf("    %8s %8s %8s %8s %6s %8s  %s\n", "wall ms", "setup", "busy", "idle", "idle%", "teardown", "test");
+    for (size_t i = 0; i < tests.size() && i < maxShown; i++)
+    {
+        auto& t = *tests[i];
+        printf("    %8lld %8lld %8lld %8lld %5.1f%% %8lld  %s\n", t.wall(), t.setup,
+            t.body - t.idle, t.idle, t.idleRatio() * 100, t.teardown, t.name.c_str());
+    }
+
+    std::vector<const TestTimes*> idleTests;
+    for (auto test: tests)
+    {
+        if (test->body >= kMinIdleRankMs && test->idle)
+            idleTests.push_back(test);
+    }
+    std::stable_sort(idleTests.begin(), idleTests.end(), [](const TestTimes* a, const TestTimes* b)
+    {
+        return a->idleRatio() > b->idleRatio();
+    });
+    if (!idleTests.empty())
+    {
+        printf("  Most idle tests (candidates for shorter timeouts, virtual time or --jobs):\n");
+        printf("    %6s %8s %8s  %s\n", "idle%", "idle ms", "wall", "test");
+        for (size_t i = 0; i < idleTests.size() && i < maxShown; i++)
+        {
+            auto& t = *idleTests[i];
+            printf("    %5.1f%% %8lld %8lld  %s\n", t.idleRatio() * 100, t.idle, t.wall(), t.name.c_str());
+        }
+    }
+
+    printf("  Critical path - group setup + longest test + group cleanup:\n");
+    printf("    %8s %8s %8s %8s  %s\n", "wall ms", "crit.", "setup", "cleanup", "group / longest test");
+    for (auto& group: mGroups)
+    {
+        auto longest = group.longest();
+        printf("    %8lld %8lld %8lld %8lld  %s\n", group.wall, group.criticalPath(),
+            group.setup, group.cleanup, group.name.c_str());
+        if (longest)
+            printf("    %35s  %s (%lld ms)\n", "", longest->name.c_str(), longest->wall());
+    }
+    printf("  Critical path: %lld ms of %lld ms wall (%.1f%%) - the shortest possible run, "
+        "if all tests of each group run in parallel\n", critical, suiteWall, percent(critical, suiteWall));
+}
+#endif
+}
+#endif
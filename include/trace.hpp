@@ -0,0 +1,212 @@
+/** @file Recording of a timeline of the test run, in the Chrome trace event format
+ *  The trace file can be viewed in chrome://tracing or in the Perfetto UI
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_TRACE_H
+#define ASYNCTEST_TRACE_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <unistd.h>
+#include "options.hpp"
+#include "srcLoc.hpp"
+#include "asyncTestConfig.hpp"
+
+namespace test
+{
+/** Collects trace events in memory and writes them to a JSON file at exit. Recording is
+ * enabled by the --trace=FILE option. When it is disabled, the cost of a trace point is
+ * a single check, and no strings are constructed */
+class Tracer
+{
+public:
+    struct Event
+    {
+        std::string name;
+        const char* cat;
+        char phase; //'B' - begin, 'E' - end, 'i' - instant, 'M' - metadata
+        long long ts; //microseconds
+        int pid;
+        int tid;
+    };
+protected:
+    const Options& mOptions;
+    std::mutex mMutex;
+    std::vector<Event> mEvents;
+    std::vector<std::string> mImported; //already serialized events, i.e. from worker processes
+    static int threadId()
+    {
+        static std::atomic<int> sLastId(0);
+        static thread_local int sId = ++sLastId;
+        return sId;
+    }
+    static void appendJsonString(std::string& out, const std::string& str)
+    {
+        out += '"';
+        for (unsigned char ch: str)
+        {
+            if (ch == '"' || ch == '\\')
+            {
+                out += '\\';
+                out += ch;
+            }
+            else if (ch < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", ch);
+                out += buf;
+            }
+            else
+            {
+                out += ch;
+            }
+        }
+        out += '"';
+    }
+    static std::string toJson(const Event& event)
+    {
+        std::string out("{\"name\":");
+        appendJsonString(out, (event.phase == 'M') ? std::string("process_name") : event.name);
+        out.append(",\"cat\":\"").append(event.cat).append("\",\"ph\":\"").append(1, event.phase)
+           .append("\",\"ts\":").append(std::to_string(event.ts))
+           .append(",\"pid\":").append(std::to_string(event.pid))
+           .append(",\"tid\":").append(std::to_string(event.tid));
+        if (event.phase == 'i')
+            out.append(",\"s\":\"t\"");
+        else if (event.phase == 'M')
+        {
+            out.append(",\"args\":{\"name\":");
+            appendJsonString(out, event.name);
+            out.append("}");
+        }
+        out.append("}");
+        return out;
+    }
+public:
+    Tracer(const Options& opts): mOptions(opts) {}
+    bool isEnabled() const { return !mOptions.traceFile.empty(); }
+    static long long now()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    void add(const std::string& name, const char* cat, char phase)
+    {
+        Event event{name, cat, phase, now(), (int)getpid(), threadId()};
+        std::lock_guard<std::mutex> lock(mMutex);
+        mEvents.push_back(std::move(event));
+    }
+    void begin(const std::string& name, const char* cat) { add(name, cat, 'B'); }
+    void end(const std::string& name, const char* cat) { add(name, cat, 'E'); }
+    void instant(const std::string& name, const char* cat) { add(name, cat, 'i'); }
+/** Names the track of the current process in the trace viewer */
+    void setProcessName(const std::string& name) { add(name, "__metadata", 'M'); }
+    size_t size() const { return mEvents.size(); }
+/** Serializes the events recorded after the specified position, i.e. in order to pass
+ * the events of a worker process to the main process */
+    std::string serialize(size_t fromPos)
+    {
+        std::string result;
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (size_t i = fromPos; i < mEvents.size(); i++)
+            result.append(toJson(mEvents[i])).append("\n");
+        return result;
+    }
+/** Adds events serialized by serialize() */
+    void import(const std::string& data)
+    {
+        size_t pos = 0;
+        std::lock_guard<std::mutex> lock(mMutex);
+        while (pos < data.size())
+        {
+            auto eol = data.find('\n', pos);
+            if (eol == std::string::npos)
+                eol = data.size();
+            if (eol > pos)
+                mImported.push_back(data.substr(pos, eol - pos));
+            pos = eol + 1;
+        }
+    }
+    void save();
+};
+
+extern Tracer gTracer;
+
+/** Records a begin event on construction and the corresponding end event on destruction */
+class TraceScope
+{
+protected:
+    std::string mName;
+    const char* mCat = nullptr;
+public:
+    TraceScope(const char* cat, const char* name, const char* suffix="")
+    {
+        if (!gTracer.isEnabled())
+            return;
+        mCat = cat;
+        mName.append(name).append(suffix);
+        gTracer.begin(mName, mCat);
+    }
+    TraceScope(const char* cat, const char* name, const std::string& suffix)
+    {
+        if (!gTracer.isEnabled())
+            return;
+        mCat = cat;
+        mName.append(name).append(suffix);
+        gTracer.begin(mName, mCat);
+    }
+/** Names the scope \c name followed by the source location, i.e. of a scheduled call */
+    TraceScope(const char* cat, const char* name, const SrcLoc& loc)
+    {
+        if (!gTracer.isEnabled())
+            return;
+        mCat = cat;
+        mName.append(name);
+        if (loc.isKnown())
+            mName.append(" ").append(loc.toString());
+        gTracer.begin(mName, mCat);
+    }
+    ~TraceScope()
+    {
+        if (mCat)
+            gTracer.end(mName, mCat);
+    }
+};
+
+#ifdef ASYNCTEST_COMPILE_IMPL
+ASYNCTEST_INLINE void Tracer::save()
+{
+    if (!isEnabled() || (mEvents.empty() && mImported.empty()))
+        return;
+    FILE* file = fopen(mOptions.traceFile.c_str(), "w");
+    if (!file)
+    {
+        fprintf(stderr, "Can't open trace file '%s' for writing\n", mOptions.traceFile.c_str());
+        return;
+    }
+    setProcessName("asyncTest");
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char* sep = "";
+    for (auto& event: mEvents)
+    {
+        fprintf(file, "%s%s", sep, toJson(event).c_str());
+        sep = ",\n";
+    }
+    for (auto& event: mImported)
+    {
+        fprintf(file, "%s%s", sep, event.c_str());
+        sep = ",\n";
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    printf("Saved %zu trace events to '%s'\n", mEvents.size() + mImported.size(),
+        mOptions.traceFile.c_str());
+}
+#endif
+}
+#endif
@@ -0,0 +1,219 @@
+/** @file A watchdog thread that detects code that doesn't complete within a deadline,
+ *  i.e. a hanging synchronous test, and the dumping of the backtraces of all threads
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_WATCHDOG_H
+#define ASYNCTEST_WATCHDOG_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#ifdef __linux__
+    #include <execinfo.h>
+    #include <dirent.h>
+    #include <sys/syscall.h>
+#endif
+#include "asyncTestConfig.hpp"
+
+namespace test
+{
+/** Calls a function on a separate thread if the code between arm() and disarm() doesn't
+ * complete within the specified time. There is one watchdog per process - a forked child
+ * gets a new one, as the thread of the parent's one doesn't exist in the child. The thread is
+ * started on the first arm(), and is woken only when a deadline is due or gets earlier, so
+ * arming and disarming cost just a mutex lock. Once the deadline has passed, the expiry wins
+ * over a disarm() that comes later, i.e. because the watched code was interrupted by the
+ * expiry function - disarm() then waits for the expiry function to return
+ */
+class Watchdog
+{
+public:
+    typedef void (*ExpiryFunc)(void* arg);
+    typedef std::chrono::steady_clock Clock;
+protected:
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::condition_variable mFiredCond; //signalled when the expiry function returns
+    std::thread* mThread = nullptr; //never joined, the thread lives until the process exits
+    bool mArmed = false;
+    bool mFiring = false; //the expiry function is running
+    bool mFired = false; //the expiry function was called since the last arm()
+    Clock::time_point mDeadline;
+    Clock::time_point mWaitUntil = Clock::time_point::max();
+    ExpiryFunc mFunc = nullptr;
+    void* mArg = nullptr;
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (;;)
+        {
+            if (!mArmed)
+            {
+                mWaitUntil = Clock::time_point::max();
+                mCond.wait(lock);
+                continue;
+            }
+            if (Clock::now() < mDeadline)
+            {
+                mWaitUntil = mDeadline;
+                mCond.wait_until(lock, mWaitUntil);
+                continue;
+            }
+            mArmed = false;
+            mFiring = mFired = true; //before func() does anything that may let the watched code continue
+            auto func = mFunc;
+            auto arg = mArg;
+            lock.unlock();
+            func(arg);
+            lock.lock();
+            mFiring = false;
+            mFiredCond.notify_all();
+        }
+    }
+    Watchdog() {}
+public:
+/** The watchdog of the current process */
+    static Watchdog& instance()
+    {
+        static Watchdog* sInstance = nullptr;
+        static pid_t sPid = 0;
+        if (sPid != getpid()) //the one of the parent process, if any, is leaked
+        {
+            sInstance = new Watchdog();
+            sPid = getpid();
+        }
+        return *sInstance;
+    }
+/** Calls \c func(arg) on the watchdog thread if disarm() is not called within \c timeoutMs */
+    void arm(int timeoutMs, ExpiryFunc func, void* arg)
+    {
+        auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mThread)
+            mThread = new std::thread([this]() { run(); });
+        mDeadline = deadline;
+        mFunc = func;
+        mArg = arg;
+        mArmed = true;
+        mFired = false;
+        if (deadline < mWaitUntil)
+            mCond.notify_one();
+    }
+/** Cancels the expiry. If the expiry function is already running, waits until it returns.
+ * Returns whether the deadline expired, i.e. whether the expiry function was called */
+    bool disarm()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mArmed = false;
+        while (mFiring)
+            mFiredCond.wait(lock);
+        return mFired;
+    }
+/** Arms the watchdog of the process for its lifetime. A zero timeout means no timeout.
+ * If the deadline expired, the destructor doesn't return before the expiry function does */
+    class Guard
+    {
+    protected:
+        bool mArmed;
+    public:
+        Guard(int timeoutMs, ExpiryFunc func, void* arg): mArmed(timeoutMs > 0)
+        {
+            if (mArmed)
+                instance().arm(timeoutMs, func, arg);
+        }
+        ~Guard()
+        {
+            if (mArmed)
+                instance().disarm();
+        }
+    };
+/** Writes the backtraces of all threads of the process, except the calling one, to \c fd.
+ * Each thread is interrupted by a signal, whose handler writes the backtrace. The function
+ * names are shown only for the symbols that are exported, i.e. when linked with -rdynamic.
+ * Supported only on Linux */
+    static void dumpBacktraces(int fd);
+protected:
+    static std::atomic<int>& dumpFd()
+    {
+        static std::atomic<int> sFd(-1);
+        return sFd;
+    }
+    static std::atomic<bool>& dumpDone()
+    {
+        static std::atomic<bool> sDone(false);
+        return sDone;
+    }
+#ifdef __linux__
+    static void onBacktraceSignal(int)
+    {
+        void* frames[64];
+        int num = backtrace(frames, 64);
+        backtrace_symbols_fd(frames, num, dumpFd());
+        dumpDone() = true;
+    }
+#endif
+};
+
+#ifdef ASYNCTEST_COMPILE_IMPL
+ASYNCTEST_INLINE void Watchdog::dumpBacktraces(int fd)
+{
+    fflush(stdout);
+    fflush(stderr);
+#ifdef __linux__
+    void* dummy[1];
+    backtrace(dummy, 1); //loads libgcc, which allocates, outside of the signal handler
+    dumpFd() = fd;
+    const int sig = SIGRTMAX;
+    struct sigaction action; //left installed, in case a thread responds after the timeout
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onBacktraceSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(sig, &action, nullptr);
+    pid_t pid = getpid();
+    pid_t self = (pid_t)syscall(SYS_gettid);
+    DIR* dir = opendir("/proc/self/task");
+    if (!dir)
+    {
+        dprintf(fd, "Can't list the threads of the process\n");
+        return;
+    }
+    while (auto entry = readdir(dir))
+    {
+        pid_t tid = atoi(entry->d_name);
+        if (tid <= 0 || tid == self)
+            continue;
+        char name[64] = "?";
+        std::string commFile = std::string("/proc/self/task/") + entry->d_name + "/comm";
+        if (FILE* comm = fopen(commFile.c_str(), "r"))
+        {
+            if (fgets(name, sizeof(name), comm))
+                name[strcspn(name, "\n")] = 0;
+            fclose(comm);
+        }
+        dprintf(fd, "--- Thread %d (%s)%s:\n", tid, name, (tid == pid) ? ", main" : "");
+        dumpDone() = false;
+        if (syscall(SYS_tgkill, pid, tid, sig) != 0)
+            continue;
+        for (int i = 0; i < 1000 && !dumpDone(); i++) //wait up to 1 second
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if (!dumpDone())
+            dprintf(fd, "(thread did not respond)\n");
+    }
+    closedir(dir);
+#else
+    dprintf(fd, "Backtraces are supported only on Linux\n");
+#endif
+}
+#endif
+}
+#endif
@@ -0,0 +1,304 @@
+/** @file Runs jobs in parallel, each in a forked child process
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_WORKERPOOL_H
+#define ASYNCTEST_WORKERPOOL_H
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <stdexcept>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "asyncTestConfig.hpp"
+
+namespace test
+{
+/** Runs jobs in forked child processes, up to a specified number at a time.
+ * Each job has a function that runs in the child and returns the result of the job
+ * as a string, and a function that is called in the parent when the child exits. The
+ * stdout and stderr of the child are captured and passed to the completion function
+ * together with the result, so that the output of parallel jobs is not interleaved.
+ * Forking gives each job a copy of the parent's state, so jobs can't interfere with
+ * each other or with the parent, and a crash or a hang affects only the job
+ */
+class WorkerPool
+{
+public:
+/** Exit code of a worker process that terminated itself because its job timed out */
+    enum { kTimeoutExitCode = 124 };
+    struct Completion
+    {
+        std::string output; //captured stdout and stderr of the child
+        std::string result; //the data returned by the child function
+        int status = 0;     //exit status, as returned by waitpid()
+        bool hasResult = false;
+        bool exitedNormally() const { return hasResult && WIFEXITED(status) && !WEXITSTATUS(status); }
+/** Describes why the child did not exit normally. Returns an empty string if it did */
+        std::string abnormalExitReason() const
+        {
+            if (exitedNormally())
+                return std::string();
+            if (WIFSIGNALED(status))
+                return std::string("Worker process killed by signal ")+std::to_string(WTERMSIG(status))
+                    +" ("+strsignal(WTERMSIG(status))+")";
+            if (WIFEXITED(status) && WEXITSTATUS(status) == kTimeoutExitCode)
+                return "Timed out, worker process terminated";
+            return "Worker process exited with code "+std::to_string(WEXITSTATUS(status))
+                +" without reporting a result";
+        }
+    };
+    typedef std::function<void(Completion&)> CompleteFunc;
+protected:
+    struct Worker
+    {
+        pid_t pid;
+        int outFd;
+        int resFd;
+        Completion completion;
+        CompleteFunc onComplete;
+    };
+    std::vector<Worker> mWorkers;
+    unsigned mMaxJobs;
+    static void writeAll(int fd, const char* data, size_t len)
+    {
+        while (len)
+        {
+            auto ret = write(fd, data, len);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+            data += ret;
+            len -= ret;
+        }
+    }
+/** Reads available data from the fd. Returns false and closes the fd on EOF */
+    static bool readSome(int& fd, std::string& out)
+    {
+        char buf[4096];
+        auto ret = read(fd, buf, sizeof(buf));
+        if (ret < 0 && errno == EINTR)
+            return true;
+        if (ret <= 0)
+        {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        out.append(buf, ret);
+        return true;
+    }
+    void complete(size_t idx);
+public:
+    WorkerPool(unsigned maxJobs): mMaxJobs(maxJobs ? maxJobs : 1) {}
+    ~WorkerPool()
+    {
+        for (auto& worker: mWorkers) //only if an exception interrupted waitAll()
+        {
+            kill(worker.pid, SIGKILL);
+            waitpid(worker.pid, nullptr, 0);
+        }
+    }
+    size_t numRunning() const { return mWorkers.size(); }
+/** Starts a job in a child process. If the max number of jobs are already running,
+ * first waits for one of them to complete.
+ * @param childFunc Executed in the child process. Returns the result of the job
+ * @param onComplete Called in the parent process when the child exits
+ */
+    template <class F>
+    void spawn(F&& childFunc, CompleteFunc&& onComplete)
+    {
+        while (mWorkers.size() >= mMaxJobs)
+            poll(-1);
+        int outPipe[2], resPipe[2];
+        if (pipe(outPipe))
+            throw std::runtime_error("WorkerPool: pipe() failed");
+        if (pipe(resPipe))
+        {
+            close(outPipe[0]); close(outPipe[1]);
+            throw std::runtime_error("WorkerPool: pipe() failed");
+        }
+        fflush(stdout); //don't duplicate buffered output in the child
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            close(outPipe[0]); close(outPipe[1]); close(resPipe[0]); close(resPipe[1]);
+            throw std::runtime_error("WorkerPool: fork() failed");
+        }
+        if (pid == 0)
+        {
+            close(outPipe[0]);
+            close(resPipe[0]);
+            for (auto& worker: mWorkers)
+            {
+                close(worker.outFd);
+                close(worker.resFd);
+            }
+            dup2(outPipe[1], 1);
+            dup2(outPipe[1], 2);
+            close(outPipe[1]);
+            setvbuf(stdout, nullptr, _IOLBF, 0); //don't lose buffered output if the job crashes
+            std::string result;
+            try
+            {
+                result = childFunc();
+            }
+            catch(std::exception& e)
+            {
+                fprintf(stderr, "Exception in worker process: %s\n", e.what());
+            }
+            catch(...)
+            {
+                fprintf(stderr, "Non-standard exception in worker process\n");
+            }
+            fflush(stdout);
+            fflush(stderr);
+            writeAll(resPipe[1], result.c_str(), result.size());
+            _exit(0); //don't run static destructors, i.e. the printing of totals
+        }
+        close(outPipe[1]);
+        close(resPipe[1]);
+        mWorkers.emplace_back();
+        auto& worker = mWorkers.back();
+        worker.pid = pid;
+        worker.outFd = outPipe[0];
+        worker.resFd = resPipe[0];
+        worker.onComplete = std::move(onComplete);
+    }
+/** Waits for output from the children, up to \c timeoutMs (-1 means infinite), and
+ * processes the completion of the ones that have exited.
+ * @returns The number of jobs that completed
+ */
+    size_t poll(int timeoutMs);
+/** Waits for all running jobs to complete */
+    void waitAll()
+    {
+        while (!mWorkers.empty())
+            poll(-1);
+    }
+};
+
+#ifdef ASYNCTEST_COMPILE_IMPL
+ASYNCTEST_INLINE void WorkerPool::complete(size_t idx)
+{
+    Worker worker = std::move(mWorkers[idx]);
+    mWorkers.erase(mWorkers.begin() + idx);
+    while (waitpid(worker.pid, &worker.completion.status, 0) < 0 && errno == EINTR);
+    worker.onComplete(worker.completion);
+}
+
+ASYNCTEST_INLINE size_t WorkerPool::poll(int timeoutMs)
+{
+    if (mWorkers.empty())
+        return 0;
+    std::vector<pollfd> fds;
+    std::vector<size_t> owners;
+    for (size_t i = 0; i < mWorkers.size(); i++)
+    {
+        auto& worker = mWorkers[i];
+        if (worker.outFd >= 0)
+        {
+            fds.push_back(pollfd{worker.outFd, POLLIN, 0});
+            owners.push_back(i);
+        }
+        if (worker.resFd >= 0)
+        {
+            fds.push_back(pollfd{worker.resFd, POLLIN, 0});
+            owners.push_back(i);
+        }
+    }
+    if (::poll(fds.data(), fds.size(), timeoutMs) < 0 && errno != EINTR)
+        throw std::runtime_error("WorkerPool: poll() failed");
+    for (size_t i = 0; i < fds.size(); i++)
+    {
+        if (!fds[i].revents)
+            continue;
+        auto& worker = mWorkers[owners[i]];
+        if (fds[i].fd == worker.outFd)
+            readSome(worker.outFd, worker.completion.output);
+        else if (!readSome(worker.resFd, worker.completion.result))
+            worker.completion.hasResult = !worker.completion.result.empty();
+    }
+    size_t numCompleted = 0;
+    for (size_t i = 0; i < mWorkers.size();)
+    {
+        if (mWorkers[i].outFd < 0 && mWorkers[i].resFd < 0)
+        {
+            complete(i);
+            numCompleted++;
+        }
+        else
+        {
+            i++;
+        }
+    }
+    return numCompleted;
+}
+#endif
+
+/** Serializes named fields of a job result, as: <name> <length>\n<data>\n */
+class RecordWriter
+{
+public:
+    std::string data;
+    RecordWriter& add(const char* name, const std::string& value)
+    {
+        data.append(name).append(" ").append(std::to_string(value.size()))
+            .append("\n").append(value).append("\n");
+        return *this;
+    }
+    RecordWriter& add(const char* name, double value)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.17g", value);
+        return add(name, std::string(buf));
+    }
+};
+
+/** Parses data produced by RecordWriter */
+class RecordReader
+{
+protected:
+    const std::string& mData;
+    size_t mPos = 0;
+public:
+    RecordReader(const std::string& data): mData(data) {}
+/** Reads the next field. Returns false at the end of the data */
+    bool next(std::string& name, std::string& value)
+    {
+        auto sp = mData.find(' ', mPos);
+        auto eol = mData.find('\n', mPos);
+        if (sp == std::string::npos || eol == std::string::npos || sp > eol)
+            return false;
+        name = mData.substr(mPos, sp - mPos);
+        size_t len = strtoul(mData.c_str() + sp + 1, nullptr, 10);
+        if (eol + 1 + len > mData.size())
+            return false;
+        value = mData.substr(eol + 1, len);
+        mPos = eol + 1 + len + 1;
+        return true;
+    }
+/** Returns the value of the first field with the specified name, or an empty string */
+    static std::string get(const std::string& data, const char* fieldName)
+    {
+        RecordReader reader(data);
+        std::string name, value;
+        while (reader.next(name, value))
+        {
+            if (name == fieldName)
+                return value;
+        }
+        return std::string();
+    }
+};
+}
+#endif
@@ -0,0 +1,13 @@
+/** @file The compiled part of the async unit testing framework, for the separate
+ *  compilation mode (see asyncTestConfig.hpp). Build it with 'make lib' in the root
+ *  directory of the repository, which produces libasynctest.a
+ *  @author Alexander Vassilev
+ */
+
+#ifndef ASYNCTEST_SEPARATE_COMPILATION
+    #define ASYNCTEST_SEPARATE_COMPILATION
+#endif
+#define ASYNCTEST_IMPLEMENTATION
+#include <asyncTest.hpp>
+
+TESTS_INIT();
@@ -0,0 +1,43 @@
+/** @file Test runner that loads test suites built as shared-object plugins, and runs them
+ *  all in one process. A plugin is a shared object that defines test groups with
+ *  registerTestGroup(), compiled in the separate compilation mode:
+ *    g++ -std=c++11 -DASYNCTEST_SEPARATE_COMPILATION -fPIC -shared -I<asyncTest>/include suite.cpp -o suite.so
+ *  The framework runtime and its globals are in the runner, so that all suites share the
+ *  options, the totals, the performance baseline and the execution time history.
+ *  Usage: asynctest-runner [options] suite1.so [suite2.so ...]
+ *  @author Alexander Vassilev
+ */
+
+#include <asyncTest.hpp>
+#include <dlfcn.h>
+
+int main(int argc, char** argv)
+{
+    test::gOptions.parse(argc, argv);
+    std::vector<std::string> plugins;
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-')
+            plugins.push_back(argv[i]);
+    }
+    if (plugins.empty())
+    {
+        fprintf(stderr, "Usage: %s [options] suite1.so [suite2.so ...]\n", argv[0]);
+        return 2;
+    }
+    auto& groups = test::GroupRegistry::groups();
+    for (auto& path: plugins)
+    {
+        if (path.find('/') == std::string::npos)
+            path = "./" + path; //don't search the library path
+        size_t numBefore = groups.size();
+        //the plugins are never unloaded, as the registry holds functions from them
+        if (!dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL))
+        {
+            fprintf(stderr, "Error loading test suite '%s': %s\n", path.c_str(), dlerror());
+            return 2;
+        }
+        printf("Loaded test suite '%s': %zu group(s)\n", path.c_str(), groups.size() - numBefore);
+    }
+    return test::runRegisteredGroups() ? 1 : 0;
+}